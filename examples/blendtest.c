@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "sil.h"
+#include "pixel.h"
+
+/*
+
+   blendtest.c: checks the integer blending used everywhere in the library
+   against the same math done in floating point, rounded to nearest. Every
+   single blend should be within 1 of it. Every version of the blend
+   functions (scalar, SSE2, AVX2, NEON) the CPU supports is tested, see
+   BlendKernel in blend.c. Returns 0 when all is fine.
+
+   Note that the float code used before truncated its results (and the
+   alpha of layer times alpha of pixel) instead of rounding, so compared
+   to that, a single blend can differ by 2. Since every blend starts with
+   the (rounded) result of the one underneath, differences of a stack of
+   layers add up, the same way they would for any 8 bit per color path.
+
+*/
+
+#define SPAN 255  /* not a multiple of SIMD width, so remainder is tested too */
+
+static UINT fails=0;
+
+static void check(const char *what, int got, double expected, int *worst) {
+  int diff=abs(got-(int)floor(expected+0.5));
+
+  if (diff>*worst) *worst=diff;
+  if (diff>1) {
+    if (fails<10) printf("%s: got %d, float gives %.2f\n",what,got,expected);
+    fails++;
+  }
+}
+
+/* sil_div255, sil_mul255 and sil_lerp255 (text, lines, circles, filters) */
+static void testPrimitives() {
+  int worst=0;
+
+  for (UINT a=0;a<256;a++) {
+    for (UINT b=0;b<256;b++) {
+      check("mul255",sil_mul255(a,b),a*b/255.0,&worst);
+      for (UINT alpha=0;alpha<256;alpha+=5) {
+        check("lerp255",sil_lerp255(a,b,alpha),(a*alpha+b*(255.0-alpha))/255.0,&worst);
+      }
+    }
+  }
+  printf("sil_mul255, sil_lerp255 : max difference %d\n",worst);
+}
+
+/* sil_blendSpan, layers onto display, with alpha of layer */
+static void testBlend() {
+  BYTE src[SPAN*4],dst[SPAN*4];
+  double af;
+  int worst=0;
+
+  for (UINT alpha=0;alpha<256;alpha+=3) {
+    for (UINT sa=1;sa<256;sa++) {
+      for (UINT sc=0;sc<256;sc+=5) {
+        for (UINT i=0;i<SPAN;i++) {
+          src[i*4]=src[i*4+1]=src[i*4+2]=sc;
+          src[i*4+3]=sa;
+          dst[i*4]=dst[i*4+1]=dst[i*4+2]=i;
+          dst[i*4+3]=255;
+        }
+        sil_blendSpan(dst,src,SPAN,alpha);
+        af=sa*alpha/(255.0*255.0);
+        for (UINT i=0;i<SPAN;i++) check("blendSpan",dst[i*4],sc*af+i*(1-af),&worst);
+      }
+    }
+  }
+  printf("  sil_blendSpan         : max difference %d\n",worst);
+}
+
+/* sil_blendPreSpan, premultiplied layers onto display */
+static void testBlendPre() {
+  BYTE src[SPAN*4],dst[SPAN*4];
+  double af;
+  int worst=0;
+
+  for (UINT alpha=0;alpha<256;alpha+=3) {
+    for (UINT sa=1;sa<256;sa++) {
+      for (UINT sc=0;sc<=sa;sc+=5) {
+        for (UINT i=0;i<SPAN;i++) {
+          src[i*4]=src[i*4+1]=src[i*4+2]=sc;
+          src[i*4+3]=sa;
+          dst[i*4]=dst[i*4+1]=dst[i*4+2]=i;
+          dst[i*4+3]=255;
+        }
+        sil_blendPreSpan(dst,src,SPAN,alpha);
+        af=sa*alpha/(255.0*255.0);
+        for (UINT i=0;i<SPAN;i++) {
+          check("blendPreSpan",dst[i*4],SIL_MIN(255,sc*alpha/255.0+i*(1-af)),&worst);
+        }
+      }
+    }
+  }
+  printf("  sil_blendPreSpan      : max difference %d\n",worst);
+}
+
+/* sil_mixSpan, blending pixels within a layer (sil_blendPixelLayer) */
+static void testMix() {
+  BYTE src[SPAN*4],dst[SPAN*4];
+  double af;
+  int worst=0;
+
+  for (UINT sa=1;sa<255;sa++) {
+    for (UINT sc=0;sc<256;sc+=3) {
+      for (UINT i=0;i<SPAN;i++) {
+        src[i*4]=src[i*4+1]=src[i*4+2]=sc;
+        src[i*4+3]=sa;
+        dst[i*4]=dst[i*4+1]=dst[i*4+2]=i;
+        dst[i*4+3]=1+i%255;
+      }
+      sil_mixSpan(dst,src,SPAN);
+      af=sa/255.0;
+      for (UINT i=0;i<SPAN;i++) {
+        check("mixSpan",dst[i*4],sc*af+i*(1-af),&worst);
+        if (dst[i*4+3]!=SIL_MAX(sa,1+i%255)) {
+          if (fails<10) printf("mixSpan: wrong alpha %d\n",dst[i*4+3]);
+          fails++;
+        }
+      }
+    }
+  }
+  printf("  sil_mixSpan           : max difference %d\n",worst);
+}
+
+/* sil_expandSpan, alpha only pixels (SILTYPE_A8) with a single color */
+static void testExpand() {
+  BYTE src[SPAN],dst[SPAN*4];
+  BYTE color[4]={10,128,250,0};
+  int worst=0;
+
+  for (UINT i=0;i<SPAN;i++) src[i]=i;
+  for (UINT ca=0;ca<256;ca++) {
+    color[3]=ca;
+    sil_expandSpan(dst,src,SPAN,color);
+    for (UINT i=0;i<SPAN;i++) {
+      check("expandSpan",dst[i*4+3],ca*i/255.0,&worst);
+      if ((dst[i*4]!=color[0])||(dst[i*4+1]!=color[1])||(dst[i*4+2]!=color[2])) {
+        if (fails<10) printf("expandSpan: wrong color at %d\n",i);
+        fails++;
+      }
+    }
+  }
+  printf("  sil_expandSpan        : max difference %d\n",worst);
+}
+
+int main() {
+  const char *names[]={"scalar","SSE2","AVX2","NEON"};
+
+  testPrimitives();
+  for (BYTE k=SILBLEND_SCALAR;k<=SILBLEND_NEON;k++) {
+    if (!BlendKernel(k)) continue;
+    printf("%s versions:\n",names[k]);
+    testBlend();
+    testBlendPre();
+    testMix();
+    testExpand();
+  }
+  if (fails) {
+    printf("FAILED: %d results differ more than 1 from float\n",fails);
+    return 1;
+  }
+  printf("OK: all results within 1 of float\n");
+  return 0;
+}
@@ -0,0 +1,647 @@
+/*
+
+   blend.c CopyRight 2021 Remco Schellekens, see LICENSE for more details.
+
+   This file contains the functions for blending rows ("spans") of pixels
+   on top of each other. Since blending is the most costly part of updating
+   the display, there are multiple versions of these functions, using the
+   SIMD instructions of the CPU (SSE2/AVX2 on x86, NEON on ARM). Which one
+   is used, is decided once (see InitBlend), depending on what CPU supports.
+
+   All versions use the same integer math, so results are identical:
+   dst = (src*alpha + dst*(255-alpha)) / 255 , rounded to nearest
+   or, for sources with colors premultiplied by alpha:
+   dst = src + dst*(255-alpha) / 255
+   Alpha only pixels (SILTYPE_A8) are expanded to a span with a single
+   color, alpha of that color multiplied with alpha of pixel.
+
+   Compared to float math, a single blend is at most 1 off. Compared to the
+   float code used before (that truncated alpha and colors), a single blend
+   can be 2 off. With stacked layers these differences add up, since every
+   blend starts with the result of the one underneath (see
+   examples/blendtest.c).
+
+   Spans are 4 bytes per pixel, with alpha as 4th byte. Order of the color
+   bytes doesn't matter, as long as source and destination are the same.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "sil.h"
+#include "log.h"
+#include "pixel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+#define SIL_BLEND_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SIL_BLEND_NEON
+#include <arm_neon.h>
+#endif
+
+typedef struct _GBLEND {
+  BYTE init;
+  void (*blend)(BYTE *, BYTE *, UINT, BYTE);
+  void (*blendpre)(BYTE *, BYTE *, UINT, BYTE);
+  void (*mix)(BYTE *, BYTE *, UINT);
+  void (*expand)(BYTE *, BYTE *, UINT, BYTE *);
+} GBLEND;
+
+static GBLEND gblend={0,NULL,NULL,NULL,NULL};
+
+
+/*****************************************************************************
+
+  Scalar versions, used on CPU's without SIMD and for the remaining pixels
+  that don't fit in a SIMD register. Use the math of pixel.h.
+
+ *****************************************************************************/
+
+static void blendScalar(BYTE *dst, BYTE *src, UINT n, BYTE alpha) {
+  UINT a,na;
+
+  for (UINT i=0;i<n;i++,src+=4,dst+=4) {
+    if (0==src[3]) continue; /* nothing to do if completely transparant */
+    a=sil_div255(src[3]*alpha);
+    if (255==a) {
+      dst[0]=src[0];
+      dst[1]=src[1];
+      dst[2]=src[2];
+    } else {
+      na=255-a;
+      dst[0]=sil_div255(src[0]*a+dst[0]*na);
+      dst[1]=sil_div255(src[1]*a+dst[1]*na);
+      dst[2]=sil_div255(src[2]*a+dst[2]*na);
+    }
+    dst[3]=255;
+  }
+}
+
+static void blendPreScalar(BYTE *dst, BYTE *src, UINT n, BYTE alpha) {
+  UINT r,g,b,a,na;
+
+  for (UINT i=0;i<n;i++,src+=4,dst+=4) {
+    if (0==src[3]) continue; /* nothing to do if completely transparant */
+    if (255==alpha) {
+      r=src[0];
+      g=src[1];
+      b=src[2];
+      a=src[3];
+    } else {
+      r=sil_div255(src[0]*alpha);
+      g=sil_div255(src[1]*alpha);
+      b=sil_div255(src[2]*alpha);
+      a=sil_div255(src[3]*alpha);
+    }
+    na=255-a;
+    dst[0]=SIL_MIN(255,r+sil_div255(dst[0]*na));
+    dst[1]=SIL_MIN(255,g+sil_div255(dst[1]*na));
+    dst[2]=SIL_MIN(255,b+sil_div255(dst[2]*na));
+    dst[3]=255;
+  }
+}
+
+static void mixScalar(BYTE *dst, BYTE *src, UINT n) {
+  UINT a,na;
+
+  for (UINT i=0;i<n;i++,src+=4,dst+=4) {
+    if (0==dst[3]) {
+      /* nothing underneath, just copy */
+      memcpy(dst,src,4);
+      continue;
+    }
+    if (0==src[3]) continue; /* nothing to do */
+    a=src[3];
+    na=255-a;
+    dst[0]=sil_div255(src[0]*a+dst[0]*na);
+    dst[1]=sil_div255(src[1]*a+dst[1]*na);
+    dst[2]=sil_div255(src[2]*a+dst[2]*na);
+    if (a>dst[3]) dst[3]=a;
+  }
+}
+
+static void expandScalar(BYTE *dst, BYTE *src, UINT n, BYTE *color) {
+  for (UINT i=0;i<n;i++,dst+=4) {
+    dst[0]=color[0];
+    dst[1]=color[1];
+    dst[2]=color[2];
+    dst[3]=(255==color[3])?src[i]:sil_div255(src[i]*color[3]);
+  }
+}
+
+#ifdef SIL_BLEND_X86
+
+/*****************************************************************************
+
+  SSE2 versions, 4 pixels at once. SSE2 is always available on x86-64.
+  Every pixel is expanded to 16 bits per color, so multiplications fit.
+
+ *****************************************************************************/
+
+static inline __m128i div255SSE2(__m128i x) {
+  x=_mm_add_epi16(x,_mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x,_mm_srli_epi16(x,8)),8);
+}
+
+/* blend 2 expanded pixels with given (expanded) alpha per pixel */
+static inline __m128i overSSE2(__m128i s, __m128i d, __m128i a) {
+  __m128i na=_mm_sub_epi16(_mm_set1_epi16(255),a);
+  return div255SSE2(_mm_add_epi16(_mm_mullo_epi16(s,a),_mm_mullo_epi16(d,na)));
+}
+
+/* copy alpha of every pixel to all 4 (expanded) values of that pixel */
+static inline __m128i spreadSSE2(__m128i x) {
+  return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x,0xFF),0xFF);
+}
+
+static void blendSSE2(BYTE *dst, BYTE *src, UINT n, BYTE alpha) {
+  const __m128i zero=_mm_setzero_si128();
+  const __m128i amask=_mm_set1_epi32(0xFF000000);
+  const __m128i la=_mm_set1_epi16(alpha);
+  __m128i s,d,sa,tmask,slo,shi,dlo,dhi,alo,ahi,res;
+  UINT i=0;
+
+  for (;i+4<=n;i+=4,src+=16,dst+=16) {
+    s=_mm_loadu_si128((__m128i *)src);
+    sa=_mm_and_si128(s,amask);
+    tmask=_mm_cmpeq_epi32(sa,zero);
+    if (0xFFFF==_mm_movemask_epi8(tmask)) continue; /* all transparant */
+    if ((255==alpha)&&(0xFFFF==_mm_movemask_epi8(_mm_cmpeq_epi32(sa,amask)))) {
+      /* all opaque, just copy */
+      _mm_storeu_si128((__m128i *)dst,s);
+      continue;
+    }
+    d=_mm_loadu_si128((__m128i *)dst);
+    slo=_mm_unpacklo_epi8(s,zero);
+    shi=_mm_unpackhi_epi8(s,zero);
+    dlo=_mm_unpacklo_epi8(d,zero);
+    dhi=_mm_unpackhi_epi8(d,zero);
+    alo=div255SSE2(_mm_mullo_epi16(spreadSSE2(slo),la));
+    ahi=div255SSE2(_mm_mullo_epi16(spreadSSE2(shi),la));
+    res=_mm_packus_epi16(overSSE2(slo,dlo,alo),overSSE2(shi,dhi,ahi));
+
+    /* transparant pixels keep their alpha, all others become opaque */
+    res=_mm_or_si128(_mm_andnot_si128(amask,res),
+                     _mm_and_si128(amask,_mm_or_si128(_mm_and_si128(tmask,d),_mm_andnot_si128(tmask,amask))));
+    _mm_storeu_si128((__m128i *)dst,res);
+  }
+  blendScalar(dst,src,n-i,alpha);
+}
+
+static void blendPreSSE2(BYTE *dst, BYTE *src, UINT n, BYTE alpha) {
+  const __m128i zero=_mm_setzero_si128();
+  const __m128i amask=_mm_set1_epi32(0xFF000000);
+  const __m128i la=_mm_set1_epi16(alpha);
+  const __m128i full=_mm_set1_epi16(255);
+  __m128i s,d,sa,tmask,slo,shi,dlo,dhi,res;
+  UINT i=0;
+
+  for (;i+4<=n;i+=4,src+=16,dst+=16) {
+    s=_mm_loadu_si128((__m128i *)src);
+    sa=_mm_and_si128(s,amask);
+    tmask=_mm_cmpeq_epi32(sa,zero);
+    if (0xFFFF==_mm_movemask_epi8(tmask)) continue; /* all transparant */
+    if ((255==alpha)&&(0xFFFF==_mm_movemask_epi8(_mm_cmpeq_epi32(sa,amask)))) {
+      /* all opaque, just copy */
+      _mm_storeu_si128((__m128i *)dst,s);
+      continue;
+    }
+    d=_mm_loadu_si128((__m128i *)dst);
+    slo=_mm_unpacklo_epi8(s,zero);
+    shi=_mm_unpackhi_epi8(s,zero);
+    if (255!=alpha) {
+      slo=div255SSE2(_mm_mullo_epi16(slo,la));
+      shi=div255SSE2(_mm_mullo_epi16(shi,la));
+    }
+    dlo=div255SSE2(_mm_mullo_epi16(_mm_unpacklo_epi8(d,zero),_mm_sub_epi16(full,spreadSSE2(slo))));
+    dhi=div255SSE2(_mm_mullo_epi16(_mm_unpackhi_epi8(d,zero),_mm_sub_epi16(full,spreadSSE2(shi))));
+    res=_mm_packus_epi16(_mm_add_epi16(slo,dlo),_mm_add_epi16(shi,dhi));
+
+    /* transparant pixels keep their alpha, all others become opaque */
+    res=_mm_or_si128(_mm_andnot_si128(amask,res),
+                     _mm_and_si128(amask,_mm_or_si128(_mm_and_si128(tmask,d),_mm_andnot_si128(tmask,amask))));
+    _mm_storeu_si128((__m128i *)dst,res);
+  }
+  blendPreScalar(dst,src,n-i,alpha);
+}
+
+static void mixSSE2(BYTE *dst, BYTE *src, UINT n) {
+  const __m128i zero=_mm_setzero_si128();
+  const __m128i amask=_mm_set1_epi32(0xFF000000);
+  __m128i s,d,ea,dzero,slo,shi,dlo,dhi,res;
+  UINT i=0;
+
+  for (;i+4<=n;i+=4,src+=16,dst+=16) {
+    s=_mm_loadu_si128((__m128i *)src);
+    d=_mm_loadu_si128((__m128i *)dst);
+
+    /* with nothing underneath, source is copied: use full alpha for those */
+    dzero=_mm_cmpeq_epi32(_mm_and_si128(d,amask),zero);
+    ea=_mm_or_si128(_mm_and_si128(dzero,amask),_mm_andnot_si128(dzero,_mm_and_si128(s,amask)));
+
+    slo=_mm_unpacklo_epi8(s,zero);
+    shi=_mm_unpackhi_epi8(s,zero);
+    dlo=_mm_unpacklo_epi8(d,zero);
+    dhi=_mm_unpackhi_epi8(d,zero);
+    res=_mm_packus_epi16(overSSE2(slo,dlo,spreadSSE2(_mm_unpacklo_epi8(ea,zero))),
+                         overSSE2(shi,dhi,spreadSSE2(_mm_unpackhi_epi8(ea,zero))));
+
+    /* resulting alpha is the highest of both */
+    res=_mm_or_si128(_mm_andnot_si128(amask,res),_mm_and_si128(amask,_mm_max_epu8(s,d)));
+    _mm_storeu_si128((__m128i *)dst,res);
+  }
+  mixScalar(dst,src,n-i);
+}
+
+/* 16 pixels at once, alpha is moved to highest byte of each pixel */
+static void expandSSE2(BYTE *dst, BYTE *src, UINT n, BYTE *color) {
+  const __m128i zero=_mm_setzero_si128();
+  const __m128i ca=_mm_set1_epi16(color[3]);
+  const __m128i rgb=_mm_set1_epi32(color[0]|(color[1]<<8)|(color[2]<<16));
+  __m128i a,lo,hi;
+  UINT i=0;
+
+  for (;i+16<=n;i+=16,src+=16,dst+=64) {
+    a=_mm_loadu_si128((__m128i *)src);
+    if (255!=color[3]) {
+      a=_mm_packus_epi16(div255SSE2(_mm_mullo_epi16(_mm_unpacklo_epi8(a,zero),ca)),
+                         div255SSE2(_mm_mullo_epi16(_mm_unpackhi_epi8(a,zero),ca)));
+    }
+    lo=_mm_unpacklo_epi8(zero,a);
+    hi=_mm_unpackhi_epi8(zero,a);
+    _mm_storeu_si128((__m128i *)dst,     _mm_or_si128(rgb,_mm_unpacklo_epi16(zero,lo)));
+    _mm_storeu_si128((__m128i *)(dst+16),_mm_or_si128(rgb,_mm_unpackhi_epi16(zero,lo)));
+    _mm_storeu_si128((__m128i *)(dst+32),_mm_or_si128(rgb,_mm_unpacklo_epi16(zero,hi)));
+    _mm_storeu_si128((__m128i *)(dst+48),_mm_or_si128(rgb,_mm_unpackhi_epi16(zero,hi)));
+  }
+  expandScalar(dst,src,n-i,color);
+}
+
+/*****************************************************************************
+
+  AVX2 versions, 8 pixels at once. Only used when CPU supports it.
+  Unpacking and packing works per 128 bit lane, so order stays the same.
+
+ *****************************************************************************/
+
+__attribute__((target("avx2")))
+static inline __m256i div255AVX2(__m256i x) {
+  x=_mm256_add_epi16(x,_mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x,_mm256_srli_epi16(x,8)),8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i overAVX2(__m256i s, __m256i d, __m256i a) {
+  __m256i na=_mm256_sub_epi16(_mm256_set1_epi16(255),a);
+  return div255AVX2(_mm256_add_epi16(_mm256_mullo_epi16(s,a),_mm256_mullo_epi16(d,na)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i spreadAVX2(__m256i x) {
+  return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x,0xFF),0xFF);
+}
+
+__attribute__((target("avx2")))
+static void blendAVX2(BYTE *dst, BYTE *src, UINT n, BYTE alpha) {
+  const __m256i zero=_mm256_setzero_si256();
+  const __m256i amask=_mm256_set1_epi32(0xFF000000);
+  const __m256i la=_mm256_set1_epi16(alpha);
+  __m256i s,d,sa,tmask,slo,shi,dlo,dhi,alo,ahi,res;
+  UINT i=0;
+
+  for (;i+8<=n;i+=8,src+=32,dst+=32) {
+    s=_mm256_loadu_si256((__m256i *)src);
+    sa=_mm256_and_si256(s,amask);
+    tmask=_mm256_cmpeq_epi32(sa,zero);
+    if (-1==_mm256_movemask_epi8(tmask)) continue; /* all transparant */
+    if ((255==alpha)&&(-1==_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa,amask)))) {
+      /* all opaque, just copy */
+      _mm256_storeu_si256((__m256i *)dst,s);
+      continue;
+    }
+    d=_mm256_loadu_si256((__m256i *)dst);
+    slo=_mm256_unpacklo_epi8(s,zero);
+    shi=_mm256_unpackhi_epi8(s,zero);
+    dlo=_mm256_unpacklo_epi8(d,zero);
+    dhi=_mm256_unpackhi_epi8(d,zero);
+    alo=div255AVX2(_mm256_mullo_epi16(spreadAVX2(slo),la));
+    ahi=div255AVX2(_mm256_mullo_epi16(spreadAVX2(shi),la));
+    res=_mm256_packus_epi16(overAVX2(slo,dlo,alo),overAVX2(shi,dhi,ahi));
+
+    /* transparant pixels keep their alpha, all others become opaque */
+    res=_mm256_or_si256(_mm256_andnot_si256(amask,res),
+                        _mm256_and_si256(amask,_mm256_or_si256(_mm256_and_si256(tmask,d),_mm256_andnot_si256(tmask,amask))));
+    _mm256_storeu_si256((__m256i *)dst,res);
+  }
+  blendSSE2(dst,src,n-i,alpha);
+}
+
+__attribute__((target("avx2")))
+static void blendPreAVX2(BYTE *dst, BYTE *src, UINT n, BYTE alpha) {
+  const __m256i zero=_mm256_setzero_si256();
+  const __m256i amask=_mm256_set1_epi32(0xFF000000);
+  const __m256i la=_mm256_set1_epi16(alpha);
+  const __m256i full=_mm256_set1_epi16(255);
+  __m256i s,d,sa,tmask,slo,shi,dlo,dhi,res;
+  UINT i=0;
+
+  for (;i+8<=n;i+=8,src+=32,dst+=32) {
+    s=_mm256_loadu_si256((__m256i *)src);
+    sa=_mm256_and_si256(s,amask);
+    tmask=_mm256_cmpeq_epi32(sa,zero);
+    if (-1==_mm256_movemask_epi8(tmask)) continue; /* all transparant */
+    if ((255==alpha)&&(-1==_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa,amask)))) {
+      /* all opaque, just copy */
+      _mm256_storeu_si256((__m256i *)dst,s);
+      continue;
+    }
+    d=_mm256_loadu_si256((__m256i *)dst);
+    slo=_mm256_unpacklo_epi8(s,zero);
+    shi=_mm256_unpackhi_epi8(s,zero);
+    if (255!=alpha) {
+      slo=div255AVX2(_mm256_mullo_epi16(slo,la));
+      shi=div255AVX2(_mm256_mullo_epi16(shi,la));
+    }
+    dlo=div255AVX2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d,zero),_mm256_sub_epi16(full,spreadAVX2(slo))));
+    dhi=div255AVX2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d,zero),_mm256_sub_epi16(full,spreadAVX2(shi))));
+    res=_mm256_packus_epi16(_mm256_add_epi16(slo,dlo),_mm256_add_epi16(shi,dhi));
+
+    /* transparant pixels keep their alpha, all others become opaque */
+    res=_mm256_or_si256(_mm256_andnot_si256(amask,res),
+                        _mm256_and_si256(amask,_mm256_or_si256(_mm256_and_si256(tmask,d),_mm256_andnot_si256(tmask,amask))));
+    _mm256_storeu_si256((__m256i *)dst,res);
+  }
+  blendPreSSE2(dst,src,n-i,alpha);
+}
+
+__attribute__((target("avx2")))
+static void mixAVX2(BYTE *dst, BYTE *src, UINT n) {
+  const __m256i zero=_mm256_setzero_si256();
+  const __m256i amask=_mm256_set1_epi32(0xFF000000);
+  __m256i s,d,ea,dzero,slo,shi,dlo,dhi,res;
+  UINT i=0;
+
+  for (;i+8<=n;i+=8,src+=32,dst+=32) {
+    s=_mm256_loadu_si256((__m256i *)src);
+    d=_mm256_loadu_si256((__m256i *)dst);
+
+    /* with nothing underneath, source is copied: use full alpha for those */
+    dzero=_mm256_cmpeq_epi32(_mm256_and_si256(d,amask),zero);
+    ea=_mm256_or_si256(_mm256_and_si256(dzero,amask),_mm256_andnot_si256(dzero,_mm256_and_si256(s,amask)));
+
+    slo=_mm256_unpacklo_epi8(s,zero);
+    shi=_mm256_unpackhi_epi8(s,zero);
+    dlo=_mm256_unpacklo_epi8(d,zero);
+    dhi=_mm256_unpackhi_epi8(d,zero);
+    res=_mm256_packus_epi16(overAVX2(slo,dlo,spreadAVX2(_mm256_unpacklo_epi8(ea,zero))),
+                            overAVX2(shi,dhi,spreadAVX2(_mm256_unpackhi_epi8(ea,zero))));
+
+    /* resulting alpha is the highest of both */
+    res=_mm256_or_si256(_mm256_andnot_si256(amask,res),_mm256_and_si256(amask,_mm256_max_epu8(s,d)));
+    _mm256_storeu_si256((__m256i *)dst,res);
+  }
+  mixSSE2(dst,src,n-i);
+}
+
+#endif
+
+#ifdef SIL_BLEND_NEON
+
+/*****************************************************************************
+
+  NEON versions, 8 pixels at once. NEON is always there on 64 bit ARM and
+  used on 32 bit ARM when compiled for it (-mfpu=neon, like on Raspberry Pi)
+  Loading with vld4 splits colors and alpha in seperate registers.
+
+ *****************************************************************************/
+
+static inline uint8x8_t div255NEON(uint16x8_t x) {
+  x=vaddq_u16(x,vdupq_n_u16(128));
+  return vaddhn_u16(x,vshrq_n_u16(x,8));
+}
+
+static inline uint8x8_t overNEON(uint8x8_t s, uint8x8_t d, uint8x8_t a) {
+  return div255NEON(vmlal_u8(vmull_u8(s,a),d,vmvn_u8(a)));
+}
+
+static void blendNEON(BYTE *dst, BYTE *src, UINT n, BYTE alpha) {
+  uint8x8x4_t s,d;
+  uint8x8_t a,tmask;
+  UINT i=0;
+
+  for (;i+8<=n;i+=8,src+=32,dst+=32) {
+    s=vld4_u8(src);
+    if (0==vget_lane_u64(vreinterpret_u64_u8(s.val[3]),0)) continue; /* all transparant */
+    d=vld4_u8(dst);
+    a=div255NEON(vmull_u8(s.val[3],vdup_n_u8(alpha)));
+    d.val[0]=overNEON(s.val[0],d.val[0],a);
+    d.val[1]=overNEON(s.val[1],d.val[1],a);
+    d.val[2]=overNEON(s.val[2],d.val[2],a);
+
+    /* transparant pixels keep their alpha, all others become opaque */
+    tmask=vceq_u8(s.val[3],vdup_n_u8(0));
+    d.val[3]=vbsl_u8(tmask,d.val[3],vdup_n_u8(255));
+    vst4_u8(dst,d);
+  }
+  blendScalar(dst,src,n-i,alpha);
+}
+
+static void blendPreNEON(BYTE *dst, BYTE *src, UINT n, BYTE alpha) {
+  uint8x8x4_t s,d;
+  uint8x8_t na,tmask;
+  UINT i=0;
+
+  for (;i+8<=n;i+=8,src+=32,dst+=32) {
+    s=vld4_u8(src);
+    if (0==vget_lane_u64(vreinterpret_u64_u8(s.val[3]),0)) continue; /* all transparant */
+    d=vld4_u8(dst);
+    tmask=vceq_u8(s.val[3],vdup_n_u8(0));
+    if (255!=alpha) {
+      s.val[0]=div255NEON(vmull_u8(s.val[0],vdup_n_u8(alpha)));
+      s.val[1]=div255NEON(vmull_u8(s.val[1],vdup_n_u8(alpha)));
+      s.val[2]=div255NEON(vmull_u8(s.val[2],vdup_n_u8(alpha)));
+      s.val[3]=div255NEON(vmull_u8(s.val[3],vdup_n_u8(alpha)));
+    }
+    na=vmvn_u8(s.val[3]);
+    d.val[0]=vqadd_u8(s.val[0],div255NEON(vmull_u8(d.val[0],na)));
+    d.val[1]=vqadd_u8(s.val[1],div255NEON(vmull_u8(d.val[1],na)));
+    d.val[2]=vqadd_u8(s.val[2],div255NEON(vmull_u8(d.val[2],na)));
+
+    /* transparant pixels keep their alpha, all others become opaque */
+    d.val[3]=vbsl_u8(tmask,d.val[3],vdup_n_u8(255));
+    vst4_u8(dst,d);
+  }
+  blendPreScalar(dst,src,n-i,alpha);
+}
+
+static void mixNEON(BYTE *dst, BYTE *src, UINT n) {
+  uint8x8x4_t s,d;
+  uint8x8_t a;
+  UINT i=0;
+
+  for (;i+8<=n;i+=8,src+=32,dst+=32) {
+    s=vld4_u8(src);
+    d=vld4_u8(dst);
+
+    /* with nothing underneath, source is copied: use full alpha for those */
+    a=vbsl_u8(vceq_u8(d.val[3],vdup_n_u8(0)),vdup_n_u8(255),s.val[3]);
+    d.val[0]=overNEON(s.val[0],d.val[0],a);
+    d.val[1]=overNEON(s.val[1],d.val[1],a);
+    d.val[2]=overNEON(s.val[2],d.val[2],a);
+
+    /* resulting alpha is the highest of both */
+    d.val[3]=vmax_u8(s.val[3],d.val[3]);
+    vst4_u8(dst,d);
+  }
+  mixScalar(dst,src,n-i);
+}
+
+static void expandNEON(BYTE *dst, BYTE *src, UINT n, BYTE *color) {
+  uint8x8x4_t d;
+  UINT i=0;
+
+  d.val[0]=vdup_n_u8(color[0]);
+  d.val[1]=vdup_n_u8(color[1]);
+  d.val[2]=vdup_n_u8(color[2]);
+  for (;i+8<=n;i+=8,src+=8,dst+=32) {
+    d.val[3]=vld1_u8(src);
+    if (255!=color[3]) d.val[3]=div255NEON(vmull_u8(d.val[3],vdup_n_u8(color[3])));
+    vst4_u8(dst,d);
+  }
+  expandScalar(dst,src,n-i,color);
+}
+
+#endif
+
+/*****************************************************************************
+
+  Internal function: use given versions of blend functions (SILBLEND_...), 
+  if CPU supports them. AVX2 has no version of expand, SSE2 one is used.
+  Returns 0 if given versions aren't available. Besides InitBlend, used by 
+  examples/blendtest.c to test every version.
+
+ *****************************************************************************/
+
+UINT BlendKernel(BYTE kernel) {
+  switch (kernel) {
+    case SILBLEND_SCALAR:
+      gblend.blend=blendScalar;
+      gblend.blendpre=blendPreScalar;
+      gblend.mix=mixScalar;
+      gblend.expand=expandScalar;
+      break;
+#ifdef SIL_BLEND_X86
+    case SILBLEND_SSE2:
+      gblend.blend=blendSSE2;
+      gblend.blendpre=blendPreSSE2;
+      gblend.mix=mixSSE2;
+      gblend.expand=expandSSE2;
+      break;
+    case SILBLEND_AVX2:
+      __builtin_cpu_init();
+      if (!__builtin_cpu_supports("avx2")) return 0;
+      gblend.blend=blendAVX2;
+      gblend.blendpre=blendPreAVX2;
+      gblend.mix=mixAVX2;
+      gblend.expand=expandSSE2;
+      break;
+#endif
+#ifdef SIL_BLEND_NEON
+    case SILBLEND_NEON:
+      gblend.blend=blendNEON;
+      gblend.blendpre=blendPreNEON;
+      gblend.mix=mixNEON;
+      gblend.expand=expandNEON;
+      break;
+#endif
+    default:
+      return 0;
+  }
+  gblend.init=1;
+  return 1;
+}
+
+/*****************************************************************************
+
+  Internal function: pick the fastest versions the CPU supports. Called by
+  sil_initSIL and sil_setRenderThreads, before any render thread can use 
+  them. Blend functions still call it on first use, for programs that 
+  don't initialize SIL.
+
+ *****************************************************************************/
+
+void InitBlend() {
+  if (gblend.init) return;
+  if (BlendKernel(SILBLEND_AVX2)) return;
+  if (BlendKernel(SILBLEND_SSE2)) return;
+  if (BlendKernel(SILBLEND_NEON)) return;
+  BlendKernel(SILBLEND_SCALAR);
+}
+
+/*****************************************************************************
+
+  Blend span of pixels on top of another one, like done when merging layers
+  into the display. Fully transparant pixels are skipped, all other pixels
+  become opaque.
+
+  In: destination span, source span, number of pixels,
+      alpha of source as a whole (255=use alpha of pixels as is)
+
+ *****************************************************************************/
+
+void sil_blendSpan(BYTE *dst, BYTE *src, UINT n, BYTE alpha) {
+  if (!gblend.init) InitBlend();
+  gblend.blend(dst,src,n,alpha);
+}
+
+/*****************************************************************************
+
+  Same as sil_blendSpan, but colors of source span are premultiplied with 
+  their alpha (see SILTYPE_PARGB), saving a multiplication per color. 
+  Like sil_blendSpan, alpha of destination isn't used, so destination 
+  doesn't need to be premultiplied.
+
+  In: destination span, source span, number of pixels,
+      alpha of source as a whole (255=use alpha of pixels as is)
+
+ *****************************************************************************/
+
+void sil_blendPreSpan(BYTE *dst, BYTE *src, UINT n, BYTE alpha) {
+  if (!gblend.init) InitBlend();
+  gblend.blendpre(dst,src,n,alpha);
+}
+
+/*****************************************************************************
+
+  Mix span of pixels on top of another one, like sil_blendPixelLayer does:
+  when destination pixel is fully transparant, source pixel is copied,
+  otherwise colors are blended and highest alpha is kept.
+
+  In: destination span, source span, number of pixels
+
+ *****************************************************************************/
+
+void sil_mixSpan(BYTE *dst, BYTE *src, UINT n) {
+  if (!gblend.init) InitBlend();
+  gblend.mix(dst,src,n);
+}
+
+/*****************************************************************************
+
+  Expand span of alpha only pixels (SILTYPE_A8) to a span of rgba pixels, 
+  all with given color. Alpha of color is multiplied with alpha of pixels.
+
+  In: destination span, alpha values (1 byte per pixel), number of pixels,
+      color (red,green,blue,alpha)
+
+ *****************************************************************************/
+
+void sil_expandSpan(BYTE *dst, BYTE *src, UINT n, BYTE *color) {
+  if (!gblend.init) InitBlend();
+  gblend.expand(dst,src,n,color);
+}
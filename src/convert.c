@@ -0,0 +1,450 @@
+/*
+
+   convert.c CopyRight 2021 Remco Schellekens, see LICENSE for more details.
+
+   This file contains the functions for converting pixels of a framebuffer
+   into another one, of a different type (or the same one). Used for
+   displays, saving to .png files and loading them.
+
+   Which function converts a row is taken from a table, filled on first use,
+   with specialised versions for the common combinations:
+   - same type: just copy bytes
+   - 32 bit types with red and blue swapped: swizzle (SSE2 / NEON)
+   - 32 bit types from and to 24 bit types: add or remove alpha
+   - 32 bit types to 565: shifts and masks
+   - 8 and 16 bit types to 32 bit types: lookup tables, build from the
+     results of FBToSpan itself, so conversion gives the exact same colors
+   All other combinations go via spans (the span functions of pixel.h, or
+   FBToSpan / SpanToFB for types not in there). Optionally,
+   colors are ordered dithered when converting to types with less bits
+   per color (332, 444, 555, 565 and 666), that always goes via spans too.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "sil.h"
+#include "log.h"
+#include "pixel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+#define SIL_CONVERT_X86
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SIL_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+#define SILTYPE_MAX 19
+
+/* convert row of n pixels, lookup table only used by some */
+typedef void (*CONVROW)(BYTE *, BYTE *, UINT, UINT *);
+
+typedef struct _GCONV {
+  BYTE init;
+  CONVROW row[SILTYPE_MAX+1][SILTYPE_MAX+1];
+  UINT *lut[SILTYPE_MAX+1][2];   /* per source type, to ABGR and to ARGB */
+} GCONV;
+
+static GCONV gconv;
+
+/* bytes per pixel, 0 if pixels don't start at byte boundaries */
+static const BYTE bpp[SILTYPE_MAX+1]={
+  0,1,1,0,0,2,2,2,2,3,3,3,3,4,4,0,4,1,1,0
+};
+
+/* distance between colors (red,green,blue) that can be stored, to dither */
+static const BYTE steps[SILTYPE_MAX+1][3]={
+  {0,0,0},{32,32,64},{64,32,32},{16,16,16},{16,16,16},{8,8,8},{8,8,8},
+  {8,4,8},{8,4,8},{4,4,4},{4,4,4},{0,0,0},{0,0,0},{0,0,0},{0,0,0},{0,0,0},
+  {0,0,0},{0,0,0},{0,0,0},{0,0,0}
+};
+
+/* 4x4 ordered dithering matrix ("Bayer") */
+static const BYTE bayer[4][4]={
+  { 0, 8, 2,10},
+  {12, 4,14, 6},
+  { 3,11, 1, 9},
+  {15, 7,13, 5}
+};
+
+
+/*****************************************************************************
+
+  Internal functions: row converters. 32 bit types are ABGR (r,g,b,a in
+  memory) and ARGB (b,g,r,a), "keep" versions keep order of colors,
+  "swap" versions swap first and third color.
+
+ *****************************************************************************/
+
+static void swapScalar(BYTE *dst, BYTE *src, UINT n) {
+  BYTE tmp;
+
+  for (UINT i=0;i<n;i++,src+=4,dst+=4) {
+    tmp=src[0];
+    dst[0]=src[2];
+    dst[1]=src[1];
+    dst[2]=tmp;
+    dst[3]=src[3];
+  }
+}
+
+static void swap32(BYTE *dst, BYTE *src, UINT n, UINT *lut) {
+  UINT i=0;
+#ifdef SIL_CONVERT_X86
+  const __m128i gamask=_mm_set1_epi32(0xFF00FF00);
+  const __m128i rbmask=_mm_set1_epi32(0x00FF00FF);
+  __m128i s,rb;
+
+  for (;i+4<=n;i+=4,src+=16,dst+=16) {
+    s=_mm_loadu_si128((__m128i *)src);
+    rb=_mm_and_si128(s,rbmask);
+    rb=_mm_or_si128(_mm_slli_epi32(rb,16),_mm_srli_epi32(rb,16));
+    _mm_storeu_si128((__m128i *)dst,_mm_or_si128(_mm_and_si128(s,gamask),rb));
+  }
+#endif
+#ifdef SIL_CONVERT_NEON
+  uint8x16x4_t s;
+  uint8x16_t tmp;
+
+  for (;i+16<=n;i+=16,src+=64,dst+=64) {
+    s=vld4q_u8(src);
+    tmp=s.val[0];
+    s.val[0]=s.val[2];
+    s.val[2]=tmp;
+    vst4q_u8(dst,s);
+  }
+#endif
+  (void)lut; /* no lookup table needed */
+  swapScalar(dst,src,n-i);
+}
+
+static void keep32to24(BYTE *dst, BYTE *src, UINT n, UINT *lut) {
+  (void)lut; /* no lookup table needed */
+  for (UINT i=0;i<n;i++,src+=4,dst+=3) {
+    dst[0]=src[0];
+    dst[1]=src[1];
+    dst[2]=src[2];
+  }
+}
+
+static void swap32to24(BYTE *dst, BYTE *src, UINT n, UINT *lut) {
+  (void)lut; /* no lookup table needed */
+  for (UINT i=0;i<n;i++,src+=4,dst+=3) {
+    dst[0]=src[2];
+    dst[1]=src[1];
+    dst[2]=src[0];
+  }
+}
+
+static void keep24to32(BYTE *dst, BYTE *src, UINT n, UINT *lut) {
+  (void)lut; /* no lookup table needed */
+  for (UINT i=0;i<n;i++,src+=3,dst+=4) {
+    dst[0]=src[0];
+    dst[1]=src[1];
+    dst[2]=src[2];
+    dst[3]=255;
+  }
+}
+
+static void swap24to32(BYTE *dst, BYTE *src, UINT n, UINT *lut) {
+  (void)lut; /* no lookup table needed */
+  for (UINT i=0;i<n;i++,src+=3,dst+=4) {
+    dst[0]=src[2];
+    dst[1]=src[1];
+    dst[2]=src[0];
+    dst[3]=255;
+  }
+}
+
+/* first byte of 32 bit pixel ends up in highest bits of 565 pixel */
+static void keep32to565(BYTE *dst, BYTE *src, UINT n, UINT *lut) {
+  (void)lut; /* no lookup table needed */
+  for (UINT i=0;i<n;i++,src+=4,dst+=2) {
+    dst[1]= (src[0]&0xF8)    |((src[1]&0xE0)>>5);
+    dst[0]=((src[1]&0x1C)<<3)| (src[2]>>3);
+  }
+}
+
+static void swap32to565(BYTE *dst, BYTE *src, UINT n, UINT *lut) {
+  (void)lut; /* no lookup table needed */
+  for (UINT i=0;i<n;i++,src+=4,dst+=2) {
+    dst[1]= (src[2]&0xF8)    |((src[1]&0xE0)>>5);
+    dst[0]=((src[1]&0x1C)<<3)| (src[0]>>3);
+  }
+}
+
+/* lookup table: all 256 values of a pixel */
+static void lut8to32(BYTE *dst, BYTE *src, UINT n, UINT *lut) {
+  for (UINT i=0;i<n;i++,dst+=4) {
+    memcpy(dst,&lut[src[i]],4);
+  }
+}
+
+/* lookup table: 256 values of first byte, followed by 256 of second one */
+static void lut16to32(BYTE *dst, BYTE *src, UINT n, UINT *lut) {
+  UINT val;
+
+  for (UINT i=0;i<n;i++,src+=2,dst+=4) {
+    val=lut[src[0]]|lut[256+src[1]];
+    memcpy(dst,&val,4);
+  }
+}
+
+/*****************************************************************************
+
+  Internal function: build lookup table for converting 8 or 16 bit type to
+  ABGR (swap=0) or ARGB (swap=1). Every value of every byte is converted
+  via FBToSpan, for 16 bit types with the other byte zero, all colors are
+  a combination of bits of either byte, so they can be "or"-ed together.
+
+ *****************************************************************************/
+
+static UINT *buildLut(BYTE type, BYTE swap) {
+  SILFB *fb;
+  UINT *lut;
+  BYTE rgba[4];
+
+  fb=sil_initFB(1,1,type);
+  if (NULL==fb) return NULL;
+  lut=calloc(bpp[type]*256,sizeof(UINT));
+  if (NULL==lut) {
+    sil_destroyFB(fb);
+    return NULL;
+  }
+  for (UINT b=0;b<bpp[type];b++) {
+    for (UINT v=0;v<256;v++) {
+      memset(fb->buf,0,bpp[type]);
+      fb->buf[b]=v;
+      FBToSpan(fb,0,0,1,rgba);
+      if (swap) swapScalar(rgba,rgba,1);
+      memcpy(&lut[b*256+v],rgba,4);
+    }
+  }
+  sil_destroyFB(fb);
+  return lut;
+}
+
+/*****************************************************************************
+
+  Internal function: fill table with specialised row converters
+
+ *****************************************************************************/
+
+static void initConvert() {
+  static const BYTE lowtypes[]={
+    SILTYPE_332RGB,SILTYPE_332BGR,SILTYPE_555RGB,SILTYPE_555BGR,
+    SILTYPE_565RGB,SILTYPE_565BGR
+  };
+  BYTE t;
+
+  memset(&gconv,0,sizeof(gconv));
+
+  gconv.row[SILTYPE_ABGR][SILTYPE_ARGB]=swap32;
+  gconv.row[SILTYPE_ARGB][SILTYPE_ABGR]=swap32;
+
+  /* 888BGR has same order as ABGR (r,g,b) */
+  gconv.row[SILTYPE_ABGR][SILTYPE_888BGR]=keep32to24;
+  gconv.row[SILTYPE_ARGB][SILTYPE_888RGB]=keep32to24;
+  gconv.row[SILTYPE_ABGR][SILTYPE_888RGB]=swap32to24;
+  gconv.row[SILTYPE_ARGB][SILTYPE_888BGR]=swap32to24;
+  gconv.row[SILTYPE_888BGR][SILTYPE_ABGR]=keep24to32;
+  gconv.row[SILTYPE_888RGB][SILTYPE_ARGB]=keep24to32;
+  gconv.row[SILTYPE_888RGB][SILTYPE_ABGR]=swap24to32;
+  gconv.row[SILTYPE_888BGR][SILTYPE_ARGB]=swap24to32;
+
+  /* 565BGR has red in highest bits, 565RGB blue */
+  gconv.row[SILTYPE_ABGR][SILTYPE_565BGR]=keep32to565;
+  gconv.row[SILTYPE_ARGB][SILTYPE_565RGB]=keep32to565;
+  gconv.row[SILTYPE_ABGR][SILTYPE_565RGB]=swap32to565;
+  gconv.row[SILTYPE_ARGB][SILTYPE_565BGR]=swap32to565;
+
+  /* lookup tables are build on first use */
+  for (UINT i=0;i<sizeof(lowtypes);i++) {
+    t=lowtypes[i];
+    gconv.row[t][SILTYPE_ABGR]=(1==bpp[t])?lut8to32:lut16to32;
+    gconv.row[t][SILTYPE_ARGB]=(1==bpp[t])?lut8to32:lut16to32;
+  }
+  gconv.init=1;
+}
+
+/*****************************************************************************
+
+  Internal function: get specialised row converter for combination of types
+  (and its lookup table, if needed), NULL if there isn't one
+
+ *****************************************************************************/
+
+static CONVROW getRow(BYTE from, BYTE to, UINT **lut) {
+  CONVROW row;
+  BYTE swap;
+
+  if (!gconv.init) initConvert();
+  row=gconv.row[from][to];
+  *lut=NULL;
+  if ((lut8to32==row)||(lut16to32==row)) {
+    swap=(SILTYPE_ARGB==to);
+    if (NULL==gconv.lut[from][swap]) gconv.lut[from][swap]=buildLut(from,swap);
+    *lut=gconv.lut[from][swap];
+    if (NULL==*lut) return NULL; /* no memory, do it the slow way */
+  }
+  return row;
+}
+
+/*****************************************************************************
+
+  Internal function: ordered dithering of span, before it is stored in type
+  with less bits per color. Color is raised with part of distance to next
+  color that can be stored, depending on position, so on average the
+  original color is shown.
+
+ *****************************************************************************/
+
+static void ditherSpan(BYTE *rgba, UINT n, UINT x, UINT y, const BYTE *step) {
+  const BYTE *row=bayer[y&3];
+  UINT d,v;
+
+  for (UINT i=0;i<n;i++,x++,rgba+=4) {
+    d=row[x&3];
+    for (UINT c=0;c<3;c++) {
+      v=rgba[c]+((d*step[c])>>4);
+      rgba[c]=SIL_MIN(v,255);
+    }
+  }
+}
+
+/*****************************************************************************
+
+  Internal function: convert rectangle of framebuffer into another one, 
+  without checks, errors or marking it dirty, so it can be used by the 
+  threads composing the display as well (see sil_convertFB for arguments).
+  When called with NULL as framebuffer, only the table with row converters
+  is filled, to be done before threads use it.
+
+ *****************************************************************************/
+
+void ConvertFB(SILFB *src, SILFB *dst, SILBOX *rect, UINT dx, UINT dy, BYTE flags) {
+  BYTE rgba[SILSPANCHUNK*4];
+  CONVROW row;
+  SILSPANFUNC get,put;
+  UINT *lut;
+  UINT width,height;
+  UINT cnt;
+  BYTE *sbuf,*dbuf;
+  BYTE dither=0;
+
+  if (!gconv.init) initConvert();
+  if ((NULL==src)||(NULL==dst)||(SILTYPE_EMPTY==dst->type)) return;
+
+  /* clip to both framebuffers */
+  if ((rect->minx>=src->width)||(rect->miny>=src->height)||
+      (dx>=dst->width)||(dy>=dst->height)) return;
+  width =SIL_MIN(SIL_MIN(rect->width, src->width-rect->minx), dst->width-dx);
+  height=SIL_MIN(SIL_MIN(rect->height,src->height-rect->miny),dst->height-dy);
+  if ((0==width)||(0==height)) return;
+
+  if ((flags&SILCONV_DITHER)&&(steps[dst->type][0])&&(src->type!=dst->type)) dither=1;
+
+  if ((!dither)&&(src->type==dst->type)&&(bpp[src->type])&&
+      ((NULL==src->pal)||(0==memcmp(src->pal,dst->pal,256*4)))) {
+    /* same type (and palette), just copy */
+    for (UINT y=0;y<height;y++) {
+      memmove(dst->buf+(dy+y)*dst->stride+dx*bpp[dst->type],
+              src->buf+(rect->miny+y)*src->stride+rect->minx*bpp[src->type],
+              width*bpp[src->type]);
+    }
+  } else if ((!dither)&&(row=getRow(src->type,dst->type,&lut))) {
+    for (UINT y=0;y<height;y++) {
+      sbuf=src->buf+(rect->miny+y)*src->stride+rect->minx*bpp[src->type];
+      dbuf=dst->buf+(dy+y)*dst->stride+dx*bpp[dst->type];
+      row(dbuf,sbuf,width,lut);
+    }
+  } else {
+    /* via spans, directly with span functions of both types if possible */
+    get=GetSpanFunc(src->type);
+    put=PutSpanFunc(dst->type);
+    for (UINT y=0;y<height;y++) {
+      sbuf=src->buf+(rect->miny+y)*src->stride+rect->minx*bpp[src->type];
+      dbuf=dst->buf+(dy+y)*dst->stride+dx*bpp[dst->type];
+      for (UINT x=0;x<width;x+=cnt) {
+        cnt=SIL_MIN(width-x,SILSPANCHUNK);
+        if (get) {
+          get(sbuf+x*bpp[src->type],rgba,cnt);
+        } else {
+          FBToSpan(src,rect->minx+x,rect->miny+y,cnt,rgba);
+        }
+        if (dither) ditherSpan(rgba,cnt,dx+x,dy+y,steps[dst->type]);
+        if (put) {
+          put(dbuf+x*bpp[dst->type],rgba,cnt);
+        } else {
+          SpanToFB(dst,dx+x,dy+y,cnt,rgba);
+        }
+      }
+    }
+  }
+}
+
+/*****************************************************************************
+
+  Convert pixels of rectangle of framebuffer into another framebuffer, on
+  given position, converting them into the type of that framebuffer.
+  Parts outside of either framebuffer are ignored.
+
+  In: source framebuffer, destination framebuffer, rectangle within source
+      (NULL is whole framebuffer), position in destination framebuffer,
+      flags: SILCONV_DITHER to use ordered dithering when destination
+      has less bits per color
+  Out: SILERR_ALLOK or error
+
+ *****************************************************************************/
+
+UINT sil_convertFB(SILFB *src, SILFB *dst, SILBOX *rect, UINT dx, UINT dy, BYTE flags) {
+  SILBOX all;
+  UINT width,height;
+
+#ifndef SIL_LIVEDANGEROUS
+  if ((NULL==src)||(NULL==src->buf)||(0==src->size)||
+      (NULL==dst)||(NULL==dst->buf)||(0==dst->size)) {
+    log_warn("trying to convert from or to non-initialized framebuffer");
+    sil_setErr(SILERR_NOTINIT);
+    return SILERR_NOTINIT;
+  }
+  if ((src->type>SILTYPE_MAX)||(dst->type>SILTYPE_MAX)) {
+    log_warn("trying to convert unknown framebuffer type");
+    sil_setErr(SILERR_WRONGFORMAT);
+    return SILERR_WRONGFORMAT;
+  }
+#endif
+
+  if (NULL==rect) {
+    all.minx=0;
+    all.miny=0;
+    all.width=src->width;
+    all.height=src->height;
+    rect=&all;
+  }
+
+  /* size of area that actually changes */
+  if ((rect->minx>=src->width)||(rect->miny>=src->height)||
+      (dx>=dst->width)||(dy>=dst->height)) {
+    sil_setErr(SILERR_ALLOK);
+    return SILERR_ALLOK;
+  }
+  width =SIL_MIN(SIL_MIN(rect->width, src->width-rect->minx), dst->width-dx);
+  height=SIL_MIN(SIL_MIN(rect->height,src->height-rect->miny),dst->height-dy);
+  if ((0==width)||(0==height)||(SILTYPE_EMPTY==dst->type)) {
+    sil_setErr(SILERR_ALLOK);
+    return SILERR_ALLOK;
+  }
+
+  if ((dst->cow)&&(!UnshareFB(dst))) return sil_getErr();
+  ConvertFB(src,dst,rect,dx,dy,flags);
+
+  if (SILOPACITY_ALPHA==dst->opacity) dst->opacity=SILOPACITY_UNKNOWN;
+  sil_addDirtyFB(dst,dx,dy,width,height);
+  sil_setErr(SILERR_ALLOK);
+  return SILERR_ALLOK;
+}
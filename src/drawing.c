@@ -13,6 +13,7 @@
 #include "lodepng.h"
 #include "sil.h"
 #include "log.h"
+#include "pixel.h"
 
 
 /*****************************************************************************
@@ -80,61 +81,6 @@ static int max(int a,int b) {
   return b;
 }
 
-/* primitive function to get square root (without math.h)*/
-/* found on the internet :) */
-
-static float squareroot(int number)
-{
-    int start = 0, end = number;
-    int mid;
-
-    float ans;
-
-    // To find integral part of square
-    // root of number
-    while (start <= end) {
-
-        // Find mid
-        mid = (start + end) / 2;
-
-        // If number is perfect square
-        // then break
-        if (mid * mid == number) {
-            ans = mid;
-            break;
-        }
-
-        // Increment start if integral
-        // part lies on right side
-        // of the mid
-        if (mid * mid < number) {
-            start = mid + 1;
-            ans = mid;
-        }
-
-        // Decrement end if integral part
-        // lies on the left side of the mid
-        else {
-            end = mid - 1;
-        }
-    }
-
-    // To find the fractional part
-    // of square root upto 5 decimal
-    float increment = 0.1;
-    for (int i = 0; i < 5; i++) {
-        while (ans * ans <= number) {
-            ans += increment;
-        }
-
-        // Loop terminates,
-        // when ans * ans > number
-        ans = ans - increment;
-        increment = increment / 10;
-    }
-    return ans;
-}
-
 void floodfill(SILLYR *layer, UINT x,UINT y) {
   BYTE red,green,blue,alpha;
 
@@ -243,14 +189,10 @@ UINT sil_getDrawWidth() {
 UINT sil_PNGintoLayer(SILLYR *layer,char * filename,UINT relx,UINT rely) {
   BYTE *image =NULL;
   UINT err=0;
-  UINT pos=0;
   UINT width=0;
   UINT height=0;
   UINT maxwidth=0;
   UINT maxheight=0;
-  BYTE red,green,blue,alpha;
-  float af,negaf;
-  BYTE mixred,mixgreen,mixblue,mixalpha;
 
 #ifndef SIL_LIVEDANGEROUS
   if (NULL==layer) {
@@ -314,20 +256,12 @@ UINT sil_PNGintoLayer(SILLYR *layer,char * filename,UINT relx,UINT rely) {
   } else {
     maxheight=height;
   }
-  for (int x=0; x<maxwidth; x++) {
-    for (int y=0; y<maxheight; y++) {
-      pos=4*(x+y*width);
-      red  =image[pos++];
-      green=image[pos++];
-      blue =image[pos++];
-      alpha=image[pos];
-      if ((x+relx<(layer->fb->width))&&(y+rely<(layer->fb->height))) {
-        if (layer->flags&SILFLAG_NOBLEND) {
-          sil_putPixelLayer(layer,x+relx,y+rely,red,green,blue,alpha);
-        } else {
-          sil_blendPixelLayer(layer,x+relx,y+rely,red,green,blue,alpha);
-        }
-      }
+  /* decoded image uses same byte order as spans, so copy row by row */
+  for (UINT y=0; y<maxheight; y++) {
+    if (layer->flags&SILFLAG_NOBLEND) {
+      sil_putSpanFB(layer->fb,relx,y+rely,maxwidth,image+4*y*width);
+    } else {
+      sil_blendSpanLayer(layer,relx,y+rely,maxwidth,image+4*y*width);
     }
   }
   //log_mark("ENDING");
@@ -347,6 +281,8 @@ UINT sil_PNGintoLayer(SILLYR *layer,char * filename,UINT relx,UINT rely) {
  *****************************************************************************/
 
 void sil_paintLayer(SILLYR *layer, BYTE red, BYTE green, BYTE blue, BYTE alpha) {
+  BYTE rgba[SILSPANCHUNK*4];
+  UINT cnt;
 
 #ifndef SIL_LIVEDANGEROUS
   if ((NULL==layer)||(NULL==layer->fb)||(0==layer->fb->size)) {
@@ -356,9 +292,16 @@ void sil_paintLayer(SILLYR *layer, BYTE red, BYTE green, BYTE blue, BYTE alpha)
   }
 #endif
 
-  for (int x=0;x<layer->fb->width;x++) {
-    for (int y=0;y<layer->fb->height;y++) {
-      sil_putPixelLayer(layer,x,y,red,green,blue,alpha); 
+  for (UINT i=0;i<SILSPANCHUNK;i++) {
+    rgba[i*4]  =red;
+    rgba[i*4+1]=green;
+    rgba[i*4+2]=blue;
+    rgba[i*4+3]=alpha;
+  }
+  for (UINT y=0;y<layer->fb->height;y++) {
+    for (UINT x=0;x<layer->fb->width;x+=cnt) {
+      cnt=SIL_MIN(layer->fb->width-x,SILSPANCHUNK);
+      sil_putSpanFB(layer->fb,x,y,cnt,rgba); 
     }
   }
   sil_setErr(SILERR_ALLOK);
@@ -384,6 +327,12 @@ void sil_drawText(SILLYR *layer, SILFONT *font, char *text, UINT relx, UINT rely
   UINT cnt=0;
   char tch,prevtch;
   BYTE red,green,blue,alpha;
+  BYTE fontalpha;
+  BYTE rgba[SILSPANCHUNK*4];
+  BYTE glyph[SILSPANCHUNK*4];
+  BYTE *gp;
+  UINT run,glen;
+  int start;
   SILFCHAR *chardef;
   int kerning=0;
   UINT outline=0;
@@ -404,6 +353,7 @@ void sil_drawText(SILLYR *layer, SILFONT *font, char *text, UINT relx, UINT rely
   tch=text[0];
   prevtch=0;
   outline=sil_getOutlineFont(font);
+  fontalpha=font->alpha*255+0.5;
   while((tch)&&(cursor+relx<(layer->fb->width))) {
     if (('\r'==tch)||('\n'==tch)) {
       /* end of line , lets accept all combo's of \r\n,\n,\r or even \n\r as one */
@@ -434,25 +384,51 @@ void sil_drawText(SILLYR *layer, SILFONT *font, char *text, UINT relx, UINT rely
       continue;
     }
 #endif
-    for (int x=0;x<chardef->width;x++) {
-      for (int y=0;y<chardef->height;y++) {
-        sil_getPixelFont(font,x+chardef->x,y+chardef->y,&red,&green,&blue,&alpha);
-        alpha=alpha*(font->alpha);
+    for (int y=0;y<chardef->height;y++) {
+      /* collect runs of visible pixels within row and draw them at once */
+      run=0;
+      for (int x=0;x<chardef->width;x++) {
+        /* get pixels of font image per row (or part of it) */
+        if (0==x%SILSPANCHUNK) {
+          glen=SIL_MIN(chardef->width-x,SILSPANCHUNK);
+          sil_getSpanFB(font->image,x+chardef->x,y+chardef->y,glen,glyph);
+          if (font->alphacolor) {
+            for (UINT i=0;i<glen;i++) memset(glyph+i*4,glyph[i*4+3],3);
+          }
+        }
+        gp=glyph+(x%SILSPANCHUNK)*4;
+        red  =gp[0];
+        green=gp[1];
+        blue =gp[2];
+        alpha=sil_mul255(gp[3],fontalpha);
+        start=x-run;
         if (alpha>0) {
           if (!(flags&SILTXT_KEEPCOLOR)) {
             if (!(((red==blue)&&(blue==red)&&(red<128))&&(flags&SILTXT_KEEPBLACK))) {
-              alpha=((float)alpha/255)*gd.fg.alpha;
+              alpha=sil_mul255(alpha,gd.fg.alpha);
             }
-            red=((float)red/255)*gd.fg.red;
-            green=((float)green/255)*gd.fg.green;
-            blue=((float)blue/255)*gd.fg.blue;
+            red  =sil_mul255(red,gd.fg.red);
+            green=sil_mul255(green,gd.fg.green);
+            blue =sil_mul255(blue,gd.fg.blue);
           }
           if (flags&SILTXT_PUNCHOUT) {
             if (alpha>50) alpha=0;
-            sil_putPixelLayer(layer,cursor+x+relx,y+rely+chardef->yoffset,red,green,blue,alpha);
+          }
+          rgba[run*4]  =red;
+          rgba[run*4+1]=green;
+          rgba[run*4+2]=blue;
+          rgba[run*4+3]=alpha;
+          run++;
+          /* keep collecting, unless end of row or buffer is full */
+          if ((x+1<chardef->width)&&(run<SILSPANCHUNK)) continue;
+        }
+        if (run) {
+          if (flags&SILTXT_PUNCHOUT) {
+            sil_putSpanFB(layer->fb,cursor+start+relx,y+rely+chardef->yoffset,run,rgba);
           } else {
-            sil_blendPixelLayer(layer,cursor+x+relx,y+rely+chardef->yoffset,red,green,blue,alpha);
+            sil_blendSpanLayer(layer,cursor+start+relx,y+rely+chardef->yoffset,run,rgba);
           }
+          run=0;
         }
       }
     }
@@ -542,11 +518,6 @@ UINT sil_getTextWidth(SILFONT *font, char *text, BYTE flags) {
 
 UINT sil_saveDisplay(char *filename,UINT width, UINT height, UINT wx, UINT wy) {
   SILFB *fb;
-  SILLYR *layer;
-  BYTE red,green,blue,alpha;
-  BYTE mixred,mixgreen,mixblue,mixalpha;
-  float af;
-  float negaf;
   UINT err=0;
 
   
@@ -558,44 +529,10 @@ UINT sil_saveDisplay(char *filename,UINT width, UINT height, UINT wx, UINT wy) {
   }
 
   /* merge all layers to single fb - within window of given paramaters  */
-  layer=sil_getBottom();
-  while (layer) {
-    if (!(layer->flags&SILFLAG_INVISIBLE)) {
-      for (int y=layer->view.miny; y<(layer->view.miny+layer->view.height); y++) {
-        for (int x=layer->view.minx; x<(layer->view.minx+layer->view.width); x++) {
-          int absx=x+layer->relx-layer->view.minx;
-          int absy=y+layer->rely-layer->view.miny;
-          int rx=x;
-          int ry=y;
-
-          /* draw if it is not within window */
-          if ((absx<wx)||(absy<wy)||(absx>wx+width)||(absy>wy+height)) continue;
-
-          /* adjust wx,wy to 0,0 of framebuffer */
-          absx-=wx;
-          absy-=wy;
-
-          sil_getPixelLayer(layer,rx,ry,&red,&green,&blue,&alpha);
-          if (0==alpha) continue; /* nothing to do if completely transparant */
-          alpha=alpha*layer->alpha;
-          if (255==alpha) {
-            sil_putPixelFB(fb,absx,absy,red,green,blue,255);
-          } else {
-            sil_getPixelFB(fb,absx,absy,&mixred,&mixgreen,&mixblue,&mixalpha);
-            af=((float)alpha)/255;
-            negaf=1-af;
-            red=red*af+negaf*mixred;
-            green=green*af+negaf*mixgreen;
-            blue=blue*af+negaf*mixblue;
-            sil_putPixelFB(fb,absx,absy,red,green,blue,255);
-          }
-        }
-      }
-    }
-    layer=layer->next;
-  }
+  sil_composeRegion(fb,wx,wy,width,height);
 
-  /* write to file */
+  /* write to file, PNG encoder needs rows without gaps in between */
+  for (UINT y=1;y<height;y++) memmove(fb->buf+y*width*3,fb->buf+y*fb->stride,width*3);
   err=lodepng_encode24_file(filename, fb->buf, width, height);
 
   /* destroy buffer */
@@ -633,7 +570,6 @@ UINT sil_saveLayer(SILLYR *lyr, char *filename) {
   UINT width,height;
   SILLYR *tmp;
   SILFB *fb;
-  BYTE r,g,b,a;
 
   width=lyr->fb->width;
   height=lyr->fb->height;
@@ -646,15 +582,11 @@ UINT sil_saveLayer(SILLYR *lyr, char *filename) {
   }
 
   /* copy pixel info */
-  for (int y=0;y<height;y++) {
-    for (int x=0;x<width;x++) {
-      sil_getPixelLayer(lyr,x,y,&r,&g,&b,&a);
-      sil_putPixelFB(fb,x,y,r,g,b,a);
-    }
-  }
+  sil_convertFB(lyr->fb,fb,NULL,0,0,0);
 
 
-  /* write to file */
+  /* write to file, PNG encoder needs rows without gaps in between */
+  for (UINT y=1;y<height;y++) memmove(fb->buf+y*width*3,fb->buf+y*fb->stride,width*3);
   err=lodepng_encode24_file(filename, fb->buf, width, height);
 
   /* destroy buffer */
@@ -931,7 +863,8 @@ void sil_drawLine(SILLYR *layer, UINT x1, UINT y1, UINT x2, UINT y2) {
 
 static void drawSingleLineAA(SILLYR *layer, UINT x1, UINT y1, UINT x2, UINT y2, BYTE overlap) {
   int tDeltaX, tDeltaY, tDeltaXTimes2, tDeltaYTimes2, tError, tStepX, tStepY;
-  float fraction,tan,dist;
+  int fraction,tan,dist; /* fixed point, 16 bits for part after the point */
+  BYTE alpha,nalpha;     /* alpha scaled by fraction and by 1-fraction      */
   char cor;
   
   /* don't try to draw lines that are (partially) outside of layer */
@@ -971,23 +904,26 @@ static void drawSingleLineAA(SILLYR *layer, UINT x1, UINT y1, UINT x2, UINT y2,
     /* stepping over X axis */
 
     tError = tDeltaYTimes2 - tDeltaX;
-    tan=(float)tDeltaY/(float)tDeltaX;
+    tan=((long long)tDeltaY<<16)/tDeltaX;
     dist=tan/2;
     while (x1 != x2+tStepX) {
-      fraction=0.5-dist;
+      fraction=32768-dist;
       cor=(fraction<0)?-1:1;
       fraction*=cor;
+      fraction=SIL_MIN(fraction,65536);
+      alpha =((long long)fraction*gd.fg.alpha+32768)>>16;
+      nalpha=gd.fg.alpha-alpha;
       if ((SILLO_MAJOR|SILLO_MINOR)==overlap) {
-        sil_blendBigPixelLayer(layer, x1,y1-cor*tStepY, gd.fg.red, gd.fg.green, gd.fg.blue, fraction*gd.fg.alpha);
-        sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, (1-fraction)*gd.fg.alpha);
+        sil_blendBigPixelLayer(layer, x1,y1-cor*tStepY, gd.fg.red, gd.fg.green, gd.fg.blue, alpha);
+        sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, nalpha);
       } else {
         if (SILLO_NONE==overlap) {
           sil_blendBigPixelLayer(layer, x1,y1-cor*tStepY, gd.fg.red, gd.fg.green, gd.fg.blue, gd.fg.alpha);
         } else {
           if (SILLO_MAJOR==overlap) {
-            sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, (fraction)*gd.fg.alpha);
+            sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, alpha);
           } else {
-            sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, (1-fraction)*gd.fg.alpha);
+            sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, nalpha);
           }
         }
       }
@@ -997,7 +933,7 @@ static void drawSingleLineAA(SILLYR *layer, UINT x1, UINT y1, UINT x2, UINT y2,
       if (tError >= 0) {
         y1 += tStepY;
         tError -= tDeltaXTimes2;
-        dist--;
+        dist-=65536;
       }
       tError += tDeltaYTimes2;
     }
@@ -1005,23 +941,26 @@ static void drawSingleLineAA(SILLYR *layer, UINT x1, UINT y1, UINT x2, UINT y2,
     /* stepping over y axis */
 
     tError = tDeltaXTimes2 - tDeltaY;
-    tan=(float)tDeltaX/(float)tDeltaY;
+    tan=((long long)tDeltaX<<16)/tDeltaY;
     dist=tan/2;
     while (y1 != y2+tStepY) {
-      fraction=0.5-dist;
+      fraction=32768-dist;
       cor=(fraction<0)?-1:1;
       fraction*=cor;
+      fraction=SIL_MIN(fraction,65536);
+      alpha =((long long)fraction*gd.fg.alpha+32768)>>16;
+      nalpha=gd.fg.alpha-alpha;
       if ((SILLO_MAJOR|SILLO_MINOR)==overlap) {
-        sil_blendBigPixelLayer(layer, x1-cor*tStepX, y1, gd.fg.red, gd.fg.green, gd.fg.blue, fraction*gd.fg.alpha);
-        sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, (1-fraction)*gd.fg.alpha);
+        sil_blendBigPixelLayer(layer, x1-cor*tStepX, y1, gd.fg.red, gd.fg.green, gd.fg.blue, alpha);
+        sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, nalpha);
       } else {
         if (SILLO_NONE==overlap) {
           sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, gd.fg.alpha);
         } else {
           if (SILLO_MAJOR==overlap) {
-            sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, fraction*gd.fg.alpha);
+            sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, alpha);
           } else {
-            sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, (1-fraction)*gd.fg.alpha);
+            sil_blendBigPixelLayer(layer, x1,y1, gd.fg.red, gd.fg.green, gd.fg.blue, nalpha);
           }
         }
       }
@@ -1031,7 +970,7 @@ static void drawSingleLineAA(SILLYR *layer, UINT x1, UINT y1, UINT x2, UINT y2,
       if (tError >= 0) {
         x1 += tStepX;
         tError -= tDeltaYTimes2;
-        dist--;
+        dist-=65536;
       }
       tError += tDeltaXTimes2;
     }
@@ -1443,13 +1382,13 @@ void sil_drawCircleAA(SILLYR *layer, UINT xm, UINT ym, UINT r) {
           if (ysq+xsq>=innersq-(r*2)) {
             /* AA of innercircle */
             if (width>0) {
-              alpha=gd.fg.alpha*(1-(innersq-xsq-ysq)/(2.0*r));
+              alpha=gd.fg.alpha*(2*r-(innersq-xsq-ysq))/(2*r);
               sil_blendPixelLayer(layer, xm+x1, ym+y1, gd.fg.red, gd.fg.green, gd.fg.blue, alpha);
               sil_blendPixelLayer(layer, xm+x1, ym-y1, gd.fg.red, gd.fg.green, gd.fg.blue, alpha);
               sil_blendPixelLayer(layer, xm-x1, ym+y1, gd.fg.red, gd.fg.green, gd.fg.blue, alpha);
               sil_blendPixelLayer(layer, xm-x1, ym-y1, gd.fg.red, gd.fg.green, gd.fg.blue, alpha);
             } else {
-              alpha=gd.bg.alpha*(1-(innersq-xsq-ysq)/(2.0*r));
+              alpha=gd.bg.alpha*(2*r-(innersq-xsq-ysq))/(2*r);
               sil_blendPixelLayer(layer, xm+x1, ym+y1, gd.bg.red, gd.bg.green, gd.bg.blue, alpha);
               sil_blendPixelLayer(layer, xm-x1, ym+y1, gd.bg.red, gd.bg.green, gd.bg.blue, alpha);
               sil_blendPixelLayer(layer, xm+x1, ym-y1, gd.bg.red, gd.bg.green, gd.bg.blue, alpha);
@@ -1462,13 +1401,13 @@ void sil_drawCircleAA(SILLYR *layer, UINT xm, UINT ym, UINT r) {
         /* AA of outercircle */
         if (ysq+xsq<=outersq+(r*2)) {
           if (width>0) {
-            alpha=gd.fg.alpha*(1-(xsq+ysq-outersq)/(2.0*r));
+            alpha=gd.fg.alpha*(2*r-(xsq+ysq-outersq))/(2*r);
             sil_blendPixelLayer(layer, xm+x1, ym+y1, gd.fg.red, gd.fg.green, gd.fg.blue, alpha);
             sil_blendPixelLayer(layer, xm-x1, ym+y1, gd.fg.red, gd.fg.green, gd.fg.blue, alpha);
             sil_blendPixelLayer(layer, xm+x1, ym-y1, gd.fg.red, gd.fg.green, gd.fg.blue, alpha);
             sil_blendPixelLayer(layer, xm-x1, ym-y1, gd.fg.red, gd.fg.green, gd.fg.blue, alpha);
           } else {
-            alpha=gd.bg.alpha*(1-(xsq+ysq-outersq)/(2.0*r));
+            alpha=gd.bg.alpha*(2*r-(xsq+ysq-outersq))/(2*r);
             sil_blendPixelLayer(layer, xm+x1, ym+y1, gd.bg.red, gd.bg.green, gd.bg.blue, alpha);
             sil_blendPixelLayer(layer, xm-x1, ym+y1, gd.bg.red, gd.bg.green, gd.bg.blue, alpha);
             sil_blendPixelLayer(layer, xm+x1, ym-y1, gd.bg.red, gd.bg.green, gd.bg.blue, alpha);
@@ -1561,7 +1500,8 @@ void sil_blendPixel(SILLYR *layer, UINT x, UINT y) {
 
 void sil_rescale(SILLYR *layer, UINT newwidth,UINT newheight) {
   SILFB *tmpfb;
-  BYTE red,green,blue,alpha;
+  BYTE *srcrow,*dstrow;
+  UINT srcy,prevy;
   double scaleh,scalew;
 
 #ifndef SIL_LIVEDANGEROUS
@@ -1593,28 +1533,49 @@ void sil_rescale(SILLYR *layer, UINT newwidth,UINT newheight) {
   scalew=(double)newwidth/(double)layer->fb->width;
   scaleh=(double)newheight/(double)layer->fb->height;
 
-  for (int y=0;y<newheight;y++) {
-    for (int x=0;x<newwidth;x++) {
-      sil_getPixelLayer(layer,(UINT)(x/scalew),(UINT)(y/scaleh),&red,&green,&blue,&alpha);
-      sil_putPixelFB(tmpfb,x,y,red,green,blue,alpha);
+  /* rows to hold original and rescaled pixels */
+  srcrow=malloc(layer->fb->width*4);
+  dstrow=malloc(newwidth*4);
+  if ((NULL==tmpfb)||(NULL==srcrow)||(NULL==dstrow)) {
+    log_info("ERR: Can't allocate memory for rescaling");
+    if (tmpfb) sil_destroyFB(tmpfb);
+    if (srcrow) free(srcrow);
+    if (dstrow) free(dstrow);
+    sil_setErr(SILERR_NOMEM);
+    return;
+  }
+
+  prevy=~0;
+  for (UINT y=0;y<newheight;y++) {
+    /* only fetch original row when it differs from previous one */
+    srcy=(UINT)(y/scaleh);
+    if (srcy!=prevy) {
+      sil_getSpanFB(layer->fb,0,srcy,layer->fb->width,srcrow);
+      for (UINT x=0;x<newwidth;x++) {
+        UINT srcx=(UINT)(x/scalew);
+        if (srcx<layer->fb->width) {
+          memcpy(dstrow+x*4,srcrow+srcx*4,4);
+        } else {
+          memset(dstrow+x*4,0,4);
+        }
+      }
+      prevy=srcy;
     }
+    sil_putSpanFB(tmpfb,0,y,newwidth,dstrow);
   }
+  free(srcrow);
+  free(dstrow);
 
-  /* throw away old framebuffer */
-  free(layer->fb->buf);
+  /* area of old size needs to be redrawn */
+  sil_damageLayer(layer);
 
-  /* and copy info from temp framebuffer in it */
-  layer->fb->buf=tmpfb->buf;
-  layer->fb->width=tmpfb->width;
-  layer->fb->height=tmpfb->height;
-  layer->fb->type=tmpfb->type;
-  layer->fb->size=tmpfb->size;
+  /* replace old framebuffer with temp framebuffer */
+  ReplaceFB(layer->fb,tmpfb);
   layer->view.minx=0;
   layer->view.miny=0;
-  layer->view.width=tmpfb->width;
-  layer->view.height=tmpfb->height;
+  layer->view.width=layer->fb->width;
+  layer->view.height=layer->fb->height;
 
-  
   sil_setErr(SILERR_ALLOK);
 }
 
@@ -10,6 +10,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "sil.h"
 #include "log.h"
 
@@ -36,7 +37,8 @@ static UINT precheck(SILLYR *layer) {
 UINT sil_cropAlphaFilter(SILLYR *layer) {
   UINT err=SILERR_ALLOK;
   UINT minx,maxx,miny,maxy;
-  BYTE red,green,blue,alpha;
+  BYTE rgba[SILSPANCHUNK*4];
+  UINT cnt;
 
 #ifndef SIL_LIVEDANGEROUS
   err=precheck(layer);
@@ -46,15 +48,18 @@ UINT sil_cropAlphaFilter(SILLYR *layer) {
   miny=layer->fb->height-1;
   maxx=0;
   maxy=0;
-  for (int x=0;x<layer->fb->width;x++) {
-    for (int y=0;y<layer->fb->height;y++) {
-      sil_getPixelLayer(layer,x,y,&red,&green,&blue,&alpha); 
-      if (alpha) {
-        if (x<minx) minx=x;
-        if (y<miny) miny=y;
-        if (maxx<x) maxx=x;
-        if (maxy<y) maxy=y;
-      } 
+  for (UINT y=0;y<layer->fb->height;y++) {
+    for (UINT x=0;x<layer->fb->width;x+=cnt) {
+      cnt=SIL_MIN(layer->fb->width-x,SILSPANCHUNK);
+      sil_getSpanFB(layer->fb,x,y,cnt,rgba);
+      for (UINT i=0;i<cnt;i++) {
+        if (rgba[i*4+3]) {
+          if (x+i<minx) minx=x+i;
+          if (y<miny) miny=y;
+          if (maxx<x+i) maxx=x+i;
+          if (maxy<y) maxy=y;
+        } 
+      }
     }
   }
   err=sil_resizeLayer(layer,minx,miny,maxx-minx+1,maxy-miny+1);
@@ -66,8 +71,10 @@ UINT sil_cropAlphaFilter(SILLYR *layer) {
 UINT sil_cropFirstpixelFilter(SILLYR *layer) {
   UINT err=SILERR_ALLOK;
   UINT minx,maxx,miny,maxy;
-  BYTE red,green,blue,alpha;
-  BYTE red2,green2,blue2,alpha2;
+  BYTE rgba[SILSPANCHUNK*4];
+  BYTE first[4];
+  BYTE *p;
+  UINT cnt;
 
 #ifndef SIL_LIVEDANGEROUS
   err=precheck(layer);
@@ -78,16 +85,20 @@ UINT sil_cropFirstpixelFilter(SILLYR *layer) {
   miny=layer->fb->height-1;
   maxx=0;
   maxy=0;
-  sil_getPixelLayer(layer,0,0,&red2,&green2,&blue2,&alpha2); 
-  for (int x=0;x<layer->fb->width;x++) {
-    for (int y=0;y<layer->fb->height;y++) {
-      sil_getPixelLayer(layer,x,y,&red,&green,&blue,&alpha); 
-      if ((red2!=red)||(green2!=green)||(blue2!=blue)) {
-        if (x<minx) minx=x;
-        if (y<miny) miny=y;
-        if (maxx<x) maxx=x;
-        if (maxy<y) maxy=y;
-      } 
+  sil_getSpanFB(layer->fb,0,0,1,first);
+  for (UINT y=0;y<layer->fb->height;y++) {
+    for (UINT x=0;x<layer->fb->width;x+=cnt) {
+      cnt=SIL_MIN(layer->fb->width-x,SILSPANCHUNK);
+      sil_getSpanFB(layer->fb,x,y,cnt,rgba);
+      for (UINT i=0;i<cnt;i++) {
+        p=rgba+i*4;
+        if ((first[0]!=p[0])||(first[1]!=p[1])||(first[2]!=p[2])) {
+          if (x+i<minx) minx=x+i;
+          if (y<miny) miny=y;
+          if (maxx<x+i) maxx=x+i;
+          if (maxy<y) maxy=y;
+        } 
+      }
     }
   }
   err=sil_resizeLayer(layer,minx,miny,maxx-minx+1,maxy-miny+1);
@@ -99,7 +110,8 @@ UINT sil_cropFirstpixelFilter(SILLYR *layer) {
 
 UINT sil_brightnessFilter(SILLYR *layer, int amount) {
   UINT err=SILERR_ALLOK;
-  BYTE red,green,blue,alpha;
+  BYTE rgba[SILSPANCHUNK*4];
+  UINT cnt;
 
 
 #ifndef SIL_LIVEDANGEROUS
@@ -110,37 +122,26 @@ UINT sil_brightnessFilter(SILLYR *layer, int amount) {
   if (amount<-255) amount=-255;
   if (amount>255) amount=255;
 
-  for (int x=0;x<layer->fb->width;x++) {
-    for (int y=0;y<layer->fb->height;y++) {
-      sil_getPixelLayer(layer,x,y,&red,&green,&blue,&alpha); 
-      if (amount>0) {
-        if (red+amount<=255) 
-          red+=amount;
-        else
-          red=255;
-        if (blue+amount<=255) 
-          blue+=amount;
-        else
-          blue=255;
-        if (green+amount<=255) 
-          green+=amount;
-        else
-          green=255;
-      } else {
-        if (red+amount>=0) 
-          red+=amount;
-        else
-          red=0;
-        if (green+amount>=0) 
-          green+=amount;
-        else
-          green=0;
-        if (blue+amount>=0) 
-          blue+=amount;
-        else
-          blue=0;
+  for (UINT y=0;y<layer->fb->height;y++) {
+    for (UINT x=0;x<layer->fb->width;x+=cnt) {
+      cnt=SIL_MIN(layer->fb->width-x,SILSPANCHUNK);
+      sil_getSpanFB(layer->fb,x,y,cnt,rgba);
+      for (UINT i=0;i<cnt*4;i++) {
+        /* skip alpha values */
+        if (3==(i&3)) continue;
+        if (amount>0) {
+          if (rgba[i]+amount<=255) 
+            rgba[i]+=amount;
+          else
+            rgba[i]=255;
+        } else {
+          if (rgba[i]+amount>=0) 
+            rgba[i]+=amount;
+          else
+            rgba[i]=0;
+        }
       }
-      sil_putPixelLayer(layer,x,y,red,green,blue,alpha); 
+      sil_putSpanFB(layer->fb,x,y,cnt,rgba);
     }
   }
 
@@ -148,11 +149,27 @@ UINT sil_brightnessFilter(SILLYR *layer, int amount) {
   return err;
 }
 
+/* premultiplied framebuffers are averaged premultiplied, no dark edges */
+static void getRow(SILFB *fb,UINT y,BYTE *row) {
+  if (SILTYPE_PARGB==fb->type)
+    FBToPreSpan(fb,0,y,fb->width,row);
+  else
+    sil_getSpanFB(fb,0,y,fb->width,row);
+}
+
+static void putRow(SILFB *fb,UINT y,BYTE *row) {
+  if (SILTYPE_PARGB==fb->type)
+    PreSpanToFB(fb,0,y,fb->width,row);
+  else
+    sil_putSpanFB(fb,0,y,fb->width,row);
+}
+
 UINT sil_blurFilter(SILLYR *layer ) {
   UINT err=SILERR_ALLOK;
   SILFB *dest;
   UINT cnt;
-  BYTE red,green,blue,alpha;
+  UINT width,height;
+  BYTE *rows,*top,*mid,*bottom,*out,*tmp;
   UINT dred,dgreen,dblue,dalpha;
 
 #ifndef SIL_LIVEDANGEROUS
@@ -162,103 +179,120 @@ UINT sil_blurFilter(SILLYR *layer ) {
 
   /* for this, we need to create a seperate FB temporary */
 
-  dest=sil_initFB(layer->fb->width,layer->fb->height,layer->fb->type);
+  width=layer->fb->width;
+  height=layer->fb->height;
+  dest=sil_initFB(width,height,layer->fb->type);
   if (NULL==dest) {
     log_info("ERR: Cant create framebuffer for blur filter");
     return sil_getErr();
   }
-  for (int x=0;x<layer->fb->width;x++) {
-    for (int y=0;y<layer->fb->height;y++) {
+
+  /* and room for three rows of pixels around current one + one for result */
+  rows=malloc(width*4*4);
+  if (NULL==rows) {
+    log_info("ERR: Cant allocate rows for blur filter");
+    sil_destroyFB(dest);
+    sil_setErr(SILERR_NOMEM);
+    return SILERR_NOMEM;
+  }
+  top=rows;
+  mid=rows+width*4;
+  bottom=rows+width*8;
+  out=rows+width*12;
+  getRow(layer->fb,0,mid);
+  if (height>1) getRow(layer->fb,1,bottom);
+
+  for (int y=0;y<height;y++) {
+    for (int x=0;x<width;x++) {
       cnt=0;
       /* mid */
-      sil_getPixelLayer(layer,x,y,&red,&green,&blue,&alpha);
-      dred=red;
-      dgreen=green;
-      dblue=blue;
-      dalpha=alpha;
+      dred  =mid[x*4];
+      dgreen=mid[x*4+1];
+      dblue =mid[x*4+2];
+      dalpha=mid[x*4+3];
       cnt=1;
       /* top */
       if (y-1>0) {
-        sil_getPixelLayer(layer,x,y-1,&red,&green,&blue,&alpha);
-        dred+=red;
-        dgreen+=green;
-        dblue+=blue;
-        dalpha+=alpha;
+        dred  +=top[x*4];
+        dgreen+=top[x*4+1];
+        dblue +=top[x*4+2];
+        dalpha+=top[x*4+3];
         cnt++;
         /* topright */
-        if (x+1<layer->fb->width) {
-          sil_getPixelLayer(layer,x+1,y-1,&red,&green,&blue,&alpha);
-          dred+=red;
-          dgreen+=green;
-          dblue+=blue;
-          dalpha+=alpha;
+        if (x+1<width) {
+          dred  +=top[x*4+4];
+          dgreen+=top[x*4+5];
+          dblue +=top[x*4+6];
+          dalpha+=top[x*4+7];
           cnt++;
         }
       }
       /* right */
-      if (x+1<layer->fb->width) {
-        sil_getPixelLayer(layer,x+1,y,&red,&green,&blue,&alpha);
-        dred+=red;
-        dgreen+=green;
-        dblue+=blue;
-        dalpha+=alpha;
+      if (x+1<width) {
+        dred  +=mid[x*4+4];
+        dgreen+=mid[x*4+5];
+        dblue +=mid[x*4+6];
+        dalpha+=mid[x*4+7];
         cnt++;
         /* bottomright */
-        if (y+1<layer->fb->height) {
-          sil_getPixelLayer(layer,x+1,y+1,&red,&green,&blue,&alpha);
-          dred+=red;
-          dgreen+=green;
-          dblue+=blue;
-          dalpha+=alpha;
+        if (y+1<height) {
+          dred  +=bottom[x*4+4];
+          dgreen+=bottom[x*4+5];
+          dblue +=bottom[x*4+6];
+          dalpha+=bottom[x*4+7];
           cnt++;
         }
       }
       /* bottom */
-      if (y+1<layer->fb->height) {
-        sil_getPixelLayer(layer,x,y+1,&red,&green,&blue,&alpha);
-        dred+=red;
-        dgreen+=green;
-        dblue+=blue;
-        dalpha+=alpha;
+      if (y+1<height) {
+        dred  +=bottom[x*4];
+        dgreen+=bottom[x*4+1];
+        dblue +=bottom[x*4+2];
+        dalpha+=bottom[x*4+3];
         cnt++;
         /* bottomleft */
         if (x-1>0) {
-          sil_getPixelLayer(layer,x-1,y+1,&red,&green,&blue,&alpha);
-          dred+=red;
-          dgreen+=green;
-          dblue+=blue;
-          dalpha+=alpha;
+          dred  +=bottom[x*4-4];
+          dgreen+=bottom[x*4-3];
+          dblue +=bottom[x*4-2];
+          dalpha+=bottom[x*4-1];
           cnt++;
         }
       }
       /* left */
       if (x-1>0) {
-        sil_getPixelLayer(layer,x-1,y,&red,&green,&blue,&alpha);
-        dred+=red;
-        dgreen+=green;
-        dblue+=blue;
-        dalpha+=alpha;
+        dred  +=mid[x*4-4];
+        dgreen+=mid[x*4-3];
+        dblue +=mid[x*4-2];
+        dalpha+=mid[x*4-1];
         cnt++;
         /* topleft */
         if (y-1>0) {
-          sil_getPixelLayer(layer,x-1,y-1,&red,&green,&blue,&alpha);
-          dred+=red;
-          dgreen+=green;
-          dblue+=blue;
-          dalpha+=alpha;
+          dred  +=top[x*4-4];
+          dgreen+=top[x*4-3];
+          dblue +=top[x*4-2];
+          dalpha+=top[x*4-1];
           cnt++;
         }
       }
-      red=dred/cnt;
-      green=dgreen/cnt;
-      blue=dblue/cnt;
-      alpha=dalpha/cnt;
-      sil_putPixelFB(dest,x,y,red,green,blue,alpha); 
+      out[x*4]  =dred/cnt;
+      out[x*4+1]=dgreen/cnt;
+      out[x*4+2]=dblue/cnt;
+      out[x*4+3]=dalpha/cnt;
     }
+    putRow(dest,y,out);
+
+    /* shift rows one down */
+    tmp=top;
+    top=mid;
+    mid=bottom;
+    bottom=tmp;
+    if (y+2<height) getRow(layer->fb,y+2,bottom);
   }
+  free(rows);
+
   /* swap framebuffers and remove the old one */
-  if (layer->fb->buf) free(layer->fb->buf);
-  layer->fb->buf=dest->buf;
+  ReplaceFB(layer->fb,dest);
   
   sil_setErr(err);
   return err;
@@ -287,8 +321,10 @@ UINT sil_borderFilter(SILLYR *layer ) {
 
 UINT sil_alphaFirstpixelFilter(SILLYR *layer ) {
   UINT err=SILERR_ALLOK;
-  BYTE red,green,blue,alpha;
-  BYTE red2,green2,blue2,alpha2;
+  BYTE rgba[SILSPANCHUNK*4];
+  BYTE first[4];
+  BYTE *p;
+  UINT cnt;
 
 
 #ifndef SIL_LIVEDANGEROUS
@@ -296,13 +332,15 @@ UINT sil_alphaFirstpixelFilter(SILLYR *layer ) {
   if (SILERR_ALLOK!=err) return err;
 #endif
 
-  sil_getPixelLayer(layer,0,0,&red,&green,&blue,&alpha); 
-  for (int x=0;x<layer->fb->width;x++) {
-    for (int y=0;y<layer->fb->height;y++) {
-      sil_getPixelLayer(layer,x,y,&red2,&green2,&blue2,&alpha2); 
-      if ((green==green2)&&(red==red2)&&(blue==blue2)) {
-        sil_putPixelLayer(layer,x,y,red,green,blue,0); 
+  sil_getSpanFB(layer->fb,0,0,1,first);
+  for (UINT y=0;y<layer->fb->height;y++) {
+    for (UINT x=0;x<layer->fb->width;x+=cnt) {
+      cnt=SIL_MIN(layer->fb->width-x,SILSPANCHUNK);
+      sil_getSpanFB(layer->fb,x,y,cnt,rgba);
+      for (p=rgba;p<rgba+cnt*4;p+=4) {
+        if ((first[1]==p[1])&&(first[0]==p[0])&&(first[2]==p[2])) p[3]=0;
       }
+      sil_putSpanFB(layer->fb,x,y,cnt,rgba);
     }
   }
   sil_setErr(err);
@@ -311,20 +349,23 @@ UINT sil_alphaFirstpixelFilter(SILLYR *layer ) {
 
 UINT sil_flipxFilter(SILLYR *layer ) {
   UINT err=SILERR_ALLOK;
-  BYTE red,green,blue,alpha;
-  BYTE red2,green2,blue2,alpha2;
+  BYTE rgba[SILSPANCHUNK*4];
+  BYTE rgba2[SILSPANCHUNK*4];
+  UINT cnt;
 
 #ifndef SIL_LIVEDANGEROUS
   err=precheck(layer);
   if (SILERR_ALLOK!=err) return err;
 #endif
 
-  for (int x=0;x<layer->fb->width;x++) {
-    for (int y=0;y<(layer->fb->height)/2;y++) {
-      sil_getPixelLayer(layer,x,y,&red,&green,&blue,&alpha); 
-      sil_getPixelLayer(layer,x,(layer->fb->height)-y-1,&red2,&green2,&blue2,&alpha2); 
-      sil_putPixelLayer(layer,x,y,red2,green2,blue2,alpha2); 
-      sil_putPixelLayer(layer,x,(layer->fb->height)-y-1,red,green,blue,alpha); 
+  /* swap upper rows with lower rows */
+  for (UINT y=0;y<(layer->fb->height)/2;y++) {
+    for (UINT x=0;x<layer->fb->width;x+=cnt) {
+      cnt=SIL_MIN(layer->fb->width-x,SILSPANCHUNK);
+      sil_getSpanFB(layer->fb,x,y,cnt,rgba);
+      sil_getSpanFB(layer->fb,x,(layer->fb->height)-y-1,cnt,rgba2);
+      sil_putSpanFB(layer->fb,x,y,cnt,rgba2);
+      sil_putSpanFB(layer->fb,x,(layer->fb->height)-y-1,cnt,rgba);
     }
   }
 
@@ -334,39 +375,60 @@ UINT sil_flipxFilter(SILLYR *layer ) {
 
 UINT sil_flipyFilter(SILLYR *layer ) {
   UINT err=SILERR_ALLOK;
-  BYTE red,green,blue,alpha;
-  BYTE red2,green2,blue2,alpha2;
+  BYTE *row;
+  BYTE tmp[4];
+  UINT width;
 
 #ifndef SIL_LIVEDANGEROUS
   err=precheck(layer);
   if (SILERR_ALLOK!=err) return err;
 #endif
 
-  for (int x=0;x<(layer->fb->width)/2;x++) {
-    for (int y=0;y<layer->fb->height;y++) {
-      sil_getPixelLayer(layer,x,y,&red,&green,&blue,&alpha); 
-      sil_getPixelLayer(layer,(layer->fb->width)-x-1,y,&red2,&green2,&blue2,&alpha2); 
-      sil_putPixelLayer(layer,x,y,red2,green2,blue2,alpha2); 
-      sil_putPixelLayer(layer,(layer->fb->width)-x-1,y,red,green,blue,alpha); 
+  /* mirror every row within a buffer holding the complete row */
+  width=layer->fb->width;
+  row=malloc(width*4);
+  if (NULL==row) {
+    log_info("ERR: Cant allocate row for flip filter");
+    sil_setErr(SILERR_NOMEM);
+    return SILERR_NOMEM;
+  }
+  for (UINT y=0;y<layer->fb->height;y++) {
+    sil_getSpanFB(layer->fb,0,y,width,row);
+    for (UINT x=0;x<width/2;x++) {
+      memcpy(tmp,row+x*4,4);
+      memcpy(row+x*4,row+(width-x-1)*4,4);
+      memcpy(row+(width-x-1)*4,tmp,4);
     }
+    sil_putSpanFB(layer->fb,0,y,width,row);
   }
+  free(row);
   sil_setErr(err);
   return err;
 }
 
 UINT sil_rotateColorFilter(SILLYR *layer ) {
   UINT err=SILERR_ALLOK;
-  BYTE red,green,blue,alpha;
+  BYTE rgba[SILSPANCHUNK*4];
+  BYTE *p;
+  BYTE tmp;
+  UINT cnt;
 
 #ifndef SIL_LIVEDANGEROUS
   err=precheck(layer);
   if (SILERR_ALLOK!=err) return err;
 #endif
 
-  for (int x=0;x<layer->fb->width;x++) {
-    for (int y=0;y<layer->fb->height;y++) {
-      sil_getPixelLayer(layer,x,y,&red,&green,&blue,&alpha); 
-      sil_putPixelLayer(layer,x,y,green,blue,red,alpha); 
+  for (UINT y=0;y<layer->fb->height;y++) {
+    for (UINT x=0;x<layer->fb->width;x+=cnt) {
+      cnt=SIL_MIN(layer->fb->width-x,SILSPANCHUNK);
+      sil_getSpanFB(layer->fb,x,y,cnt,rgba);
+      for (p=rgba;p<rgba+cnt*4;p+=4) {
+        tmp=p[0];
+        p[0]=p[1];
+        p[1]=p[2];
+        p[2]=tmp;
+      }
+      sil_putSpanFB(layer->fb,x,y,cnt,rgba);
     }
   }
 
@@ -376,17 +438,25 @@ UINT sil_rotateColorFilter(SILLYR *layer ) {
 
 UINT sil_reverseColorFilter(SILLYR *layer ) {
   UINT err=SILERR_ALLOK;
-  BYTE red,green,blue,alpha;
+  BYTE rgba[SILSPANCHUNK*4];
+  BYTE *p;
+  UINT cnt;
 
 #ifndef SIL_LIVEDANGEROUS
   err=precheck(layer);
   if (SILERR_ALLOK!=err) return err;
 #endif
 
-  for (int x=0;x<layer->fb->width;x++) {
-    for (int y=0;y<layer->fb->height;y++) {
-      sil_getPixelLayer(layer,x,y,&red,&green,&blue,&alpha); 
-      sil_putPixelLayer(layer,x,y,255-red,255-green,255-blue,alpha); 
+  for (UINT y=0;y<layer->fb->height;y++) {
+    for (UINT x=0;x<layer->fb->width;x+=cnt) {
+      cnt=SIL_MIN(layer->fb->width-x,SILSPANCHUNK);
+      sil_getSpanFB(layer->fb,x,y,cnt,rgba);
+      for (p=rgba;p<rgba+cnt*4;p+=4) {
+        p[0]=255-p[0];
+        p[1]=255-p[1];
+        p[2]=255-p[2];
+      }
+      sil_putSpanFB(layer->fb,x,y,cnt,rgba);
     }
   }
 
@@ -396,20 +466,26 @@ UINT sil_reverseColorFilter(SILLYR *layer ) {
 
 UINT sil_grayFilter(SILLYR *layer ) {
   UINT err=SILERR_ALLOK;
-  BYTE red,green,blue,alpha;
+  BYTE rgba[SILSPANCHUNK*4];
+  BYTE *p;
+  UINT cnt;
 
 #ifndef SIL_LIVEDANGEROUS
   err=precheck(layer);
   if (SILERR_ALLOK!=err) return err;
 #endif
 
-  for (int x=0;x<layer->fb->width;x++) {
-    for (int y=0;y<layer->fb->height;y++) {
-      sil_getPixelLayer(layer,x,y,&red,&green,&blue,&alpha); 
-      red=0.21*(float)red+0.71*(float)green+0.07*(float)blue;
-      green=red;
-      blue=red;
-      sil_putPixelLayer(layer,x,y,red,green,blue,alpha); 
+  for (UINT y=0;y<layer->fb->height;y++) {
+    for (UINT x=0;x<layer->fb->width;x+=cnt) {
+      cnt=SIL_MIN(layer->fb->width-x,SILSPANCHUNK);
+      sil_getSpanFB(layer->fb,x,y,cnt,rgba);
+      for (p=rgba;p<rgba+cnt*4;p+=4) {
+        /* 0.21 red + 0.71 green + 0.07 blue, in 1/256 parts */
+        p[0]=(54*p[0]+182*p[1]+18*p[2])>>8;
+        p[1]=p[0];
+        p[2]=p[0];
+      }
+      sil_putSpanFB(layer->fb,x,y,cnt,rgba);
     }
   }
 
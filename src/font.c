@@ -13,11 +13,54 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include "lodepng.h"
 #include "sil.h"
 #include "log.h"
 
+/*****************************************************************************
+
+  Internal function, use decoded font image as framebuffer. Most fonts only
+  use white pixels, or gray pixels as bright as their alpha, with different
+  alpha. Those only need alpha: SILTYPE_A8, a quarter of the memory. Others 
+  (colored, outlines) keep all colors.
+
+ *****************************************************************************/
+
+static SILFB *imageToFB(SILFONT *font, BYTE *image, UINT width, UINT height) {
+  SILFB *fb;
+  BYTE *p=image;
+  UINT white=1;
+  UINT gray=1;
+
+  for (UINT i=0;(i<width*height)&&(white||gray);i++,p+=4) {
+    if (0==p[3]) continue;
+    if ((p[0]!=p[1])||(p[1]!=p[2])) {
+      /* colored */
+      white=0;
+      gray=0;
+      break;
+    }
+    if (p[0]!=255) white=0;
+    if (p[0]!=p[3]) gray=0;
+  }
+  if ((!white)&&(!gray)) {
+    fb=AdoptFB(image,width,height,0,SILTYPE_ABGR);
+    if (NULL==fb) free(image);
+    return fb;
+  }
+  font->alphacolor=!white;
+  fb=sil_initFB(width,height,SILTYPE_A8);
+  if (fb) {
+    for (UINT y=0;y<height;y++) {
+      for (UINT x=0;x<width;x++) fb->buf[y*fb->stride+x]=image[(y*width+x)*4+3];
+    }
+  }
+  free(image);
+  return fb;
+}
+
 /*****************************************************************************
 
   Internal function, Initialize the font context
@@ -27,6 +70,7 @@
 
 static void initFont(SILFONT *font) {
   font->image=NULL;
+  font->alphacolor=0;
   font->width=0;
   font->height=0;
   font->lineHeight=0;
@@ -186,6 +230,7 @@ SILFONT *sil_loadFont(char *name) {
   UINT kcnt=0;
   BYTE found,waschar,quote=0;
   char *file=NULL;
+  BYTE *image=NULL;
   SILFONT *font;
 
 
@@ -297,8 +342,12 @@ SILFONT *sil_loadFont(char *name) {
           err=SILERR_NOFILEFOUND;
           file=strValue(font,"file");
           if (file ) {
-            err=lodepng_decode32_file(&font->image,&font->width,&font->height,file);
-            if (err) {
+            err=lodepng_decode32_file(&image,&font->width,&font->height,file);
+            if (!err) {
+              font->image=imageToFB(font,image,font->width,font->height);
+              if (NULL==font->image) err=SILERR_NOMEM;
+            } else {
+              if (image) free(image);
               log_err("Can't decode .png file (%s) : %d",file, err);
               switch (err) {
                 case 28:
@@ -451,7 +500,7 @@ UINT sil_getOutlineFont(SILFONT *font) {
 
  *****************************************************************************/
 void sil_getPixelFont(SILFONT *font,UINT x,UINT y, BYTE *red, BYTE *green, BYTE *blue, BYTE *alpha) {
-  UINT pos=0;
+  BYTE rgba[4];
 #ifndef SIL_LIVEDANGEROUS
   /* if font isn't initialized properly, get out */
   if ((NULL==font)||(NULL==font->image)) {
@@ -462,11 +511,12 @@ void sil_getPixelFont(SILFONT *font,UINT x,UINT y, BYTE *red, BYTE *green, BYTE
 #endif
 
   if ((x<font->width)&&(y<font->height)) { 
-    pos=4*(x+y*(font->width));
-    *red  =font->image[pos  ];
-    *green=font->image[pos+1];
-    *blue =font->image[pos+2];
-    *alpha=font->image[pos+3];
+    FBToSpan(font->image,x,y,1,rgba);
+    if (font->alphacolor) memset(rgba,rgba[3],3);
+    *red  =rgba[0];
+    *green=rgba[1];
+    *blue =rgba[2];
+    *alpha=rgba[3];
   }
   sil_setErr(SILERR_ALLOK);
 }
@@ -499,7 +549,7 @@ void sil_setAlphaFont(SILFONT *font, float alpha) {
  *****************************************************************************/
 void sil_destroyFont(SILFONT *font) {
   if (font) {
-    if (font->image) free(font->image);
+    if (font->image) sil_destroyFB(font->image);
     if (font->cdefs) free(font->cdefs);
     if (font->kdefs) free(font->kdefs);
     free(font);
@@ -14,8 +14,190 @@
 #include <stdio.h>
 #include "log.h"
 #include "sil.h"
+#include "pixel.h"
 
 
+/*****************************************************************************
+
+  Internal function: number of bytes needed for a single row of pixels of 
+  given type, 0 for unknown types. 444 pixels use 1.5 bytes, where even
+  pixels start at the low nibble of a byte, hence the extra byte. A1 pixels
+  use a single bit, first pixel is highest bit of byte.
+
+ *****************************************************************************/
+
+static UINT rowBytes(UINT width, BYTE type) {
+  switch(type) {
+    case SILTYPE_332RGB:
+    case SILTYPE_332BGR:
+    case SILTYPE_PAL8:
+    case SILTYPE_A8:
+      return width;
+    case SILTYPE_A1:
+      return (width+7)/8;
+    case SILTYPE_444RGB:
+    case SILTYPE_444BGR:
+      return width*3/2+1;
+    case SILTYPE_555RGB:
+    case SILTYPE_565RGB:
+    case SILTYPE_555BGR:
+    case SILTYPE_565BGR:
+      return width*2;
+    case SILTYPE_666RGB:
+    case SILTYPE_666BGR:
+    case SILTYPE_888RGB:
+    case SILTYPE_888BGR:
+      return width*3;
+    case SILTYPE_ABGR:
+    case SILTYPE_ARGB:
+    case SILTYPE_PARGB:
+      return width*4;
+  }
+  return 0;
+}
+
+/*****************************************************************************
+
+  Internal functions: allocate memory for pixels, cleared and with first 
+  byte aligned to SIL_FBALIGN, and release it again when last framebuffer 
+  using it is gone.
+
+ *****************************************************************************/
+
+static SILMEM *allocMem(UINT size) {
+  SILMEM *mem;
+
+  mem=calloc(1,sizeof(SILMEM));
+  if (NULL==mem) return NULL;
+#if (SIL_FBALIGN>16)&&!defined(SIL_W32)
+  /* calloc only guarantees alignment for largest basic type */
+  if (posix_memalign((void **)&mem->data,SIL_FBALIGN,size)) {
+    mem->data=NULL;
+  } else {
+    memset(mem->data,0,size);
+  }
+#else
+  mem->data=calloc(1,size);
+#endif
+  if (NULL==mem->data) {
+    free(mem);
+    return NULL;
+  }
+  mem->refs=1;
+  return mem;
+}
+
+static void releaseMem(SILMEM *mem) {
+  if ((mem)&&(0==--mem->refs)) {
+    free(mem->data);
+    free(mem);
+  }
+}
+
+/*****************************************************************************
+
+  Internal function: give framebuffer, sharing its pixels with copies (see 
+  sil_copyFB), its own memory before it is changed. Returns 0 if that 
+  fails. Also used by sil_convertFB, which writes into buffer directly.
+
+ *****************************************************************************/
+
+UINT UnshareFB(SILFB *fb) {
+  SILMEM *mem;
+
+  if (fb->mem->refs>1) {
+    mem=allocMem(fb->size);
+    if (NULL==mem) {
+      log_info("ERR: Can't allocate memory for copy of shared framebuffer");
+      sil_setErr(SILERR_NOMEM);
+      return 0;
+    }
+    memcpy(mem->data,fb->buf,fb->size);
+    releaseMem(fb->mem);
+    fb->mem=mem;
+    fb->buf=mem->data;
+  }
+  fb->cow=0;
+  return 1;
+}
+
+/*****************************************************************************
+
+  Internal function: does type have alpha per pixel
+
+ *****************************************************************************/
+
+static UINT hasAlpha(BYTE type) {
+  switch(type) {
+    case SILTYPE_ABGR:
+    case SILTYPE_ARGB:
+    case SILTYPE_PARGB:
+    case SILTYPE_PAL8:
+    case SILTYPE_A8:
+    case SILTYPE_A1:
+      return 1;
+  }
+  return 0;
+}
+
+/*****************************************************************************
+
+  Internal functions: give SILTYPE_PAL8 framebuffer its own palette, copy 
+  of given one or, if NULL, the default one (colors as 332RGB, but with 
+  index 0 fully transparent, so cleared framebuffers are invisible). 
+  SILTYPE_A8 and SILTYPE_A1 use the first entry as color of all pixels,
+  white by default. Returns 0 if that fails. 
+  And find index of palette color closest to given rgba pixel.
+
+ *****************************************************************************/
+
+static UINT initPal(SILFB *fb, BYTE *from) {
+  BYTE *p;
+
+  fb->pal=NULL;
+  if ((SILTYPE_PAL8!=fb->type)&&(SILTYPE_A8!=fb->type)&&(SILTYPE_A1!=fb->type)) return 1;
+  fb->pal=malloc(256*4);
+  if (NULL==fb->pal) {
+    log_info("ERR: Can't allocate memory for palette of framebuffer");
+    sil_setErr(SILERR_NOMEM);
+    return 0;
+  }
+  if (from) {
+    memcpy(fb->pal,from,256*4);
+    return 1;
+  }
+  p=fb->pal;
+  for (UINT i=0;i<256;i++,p+=4) {
+    p[0]=i&0xE0;
+    p[1]=(i<<3)&0xE0;
+    p[2]=(i<<6)&0xC0;
+    p[3]=i?255:0;
+  }
+  if (SILTYPE_PAL8!=fb->type) memset(fb->pal,255,4);
+  return 1;
+}
+
+static BYTE palIndex(BYTE *pal, BYTE *rgba) {
+  BYTE ret=0;
+  UINT best=~0;
+  UINT dist;
+  int dr,dg,db,da;
+
+  for (UINT i=0;i<256;i++,pal+=4) {
+    dr=pal[0]-rgba[0];
+    dg=pal[1]-rgba[1];
+    db=pal[2]-rgba[2];
+    da=pal[3]-rgba[3];
+    dist=dr*dr+dg*dg+db*db+da*da;
+    if (dist<best) {
+      if (0==dist) return i;
+      best=dist;
+      ret=i;
+    }
+  }
+  return ret;
+}
+
 /*****************************************************************************
   Initialize Framebuffer
   In: width & height of framebuffer + RGB format
@@ -30,15 +212,29 @@
   666 = 6bits + 6bits + 6bits               = 3   bytes per pixel (2 bits unused)
   888 = 8bits + 8bits + 8bits               = 3   bytes per pixel 
   ABGR/ARGB = 8bits + 8bits + 8bits + 8bits = 4   bytes per pixel 
+  PAL8      = index in palette of 256 colors + alpha (fb->pal, see 
+              sil_setPaletteFB) = 1 byte per pixel. Written pixels get 
+              closest color in palette
+  A8        = alpha only, 1 byte per pixel. All pixels have same color,
+              entry 0 of palette (white, unless set with sil_setPaletteFB)
+  A1        = same, but 1 bit per pixel: fully opaque or invisible
+  PARGB     = same as ARGB, but colors are premultiplied with alpha, 
+              faster to blend. Spans are still given/returned without 
+              premultiplied colors
 
   SILTYPE_EMPTY is used to just to support empty layers with resizable 
   dimensions, used attach eventhandlers to it.
 
+  Every row starts at a multiple of SIL_FBALIGN bytes, so there can be some
+  unused bytes at the end of a row. Use fb->stride to go from one row to the
+  next, never width*bytes per pixel.
+
  *****************************************************************************/
 
 
 SILFB *sil_initFB(UINT width, UINT height, BYTE type) {
   SILFB *fb;
+  UINT stride=0;
   UINT size=0;
 
 #ifndef SIL_LIVEDANGEROUS
@@ -51,196 +247,741 @@ SILFB *sil_initFB(UINT width, UINT height, BYTE type) {
 
 #endif
 
-  switch(type) {
-    case SILTYPE_332RGB:
-    case SILTYPE_332BGR:
-      size=width*height;
+  if (SILTYPE_EMPTY==type) {
+    size=1;
+  } else {
+    stride=rowBytes(width,type);
+    if (0==stride) {
+      /* unknown type */
+      log_info("ERR: Unknown RGB format given to greate framebuffer: %d",type);
+      sil_setErr(SILERR_WRONGFORMAT);
+      return NULL;
+    }
+    /* let every row start at an aligned address */
+    stride=(stride+SIL_FBALIGN-1)/SIL_FBALIGN*SIL_FBALIGN;
+    size=stride*height;
+  }
+
+  fb=calloc(1,sizeof(SILFB));
+  if (NULL==fb) {
+    log_info("ERR: Can't allocate memory for framebuffer struct");
+    sil_setErr(SILERR_NOMEM);
+    return NULL;
+  }
+
+  fb->mem=allocMem(size);
+  if (NULL==fb->mem) {
+    free(fb);
+    log_info("ERR: Can't allocate memory for buffer of framebuffer");
+    sil_setErr(SILERR_NOMEM);
+    return NULL;
+  }
+  fb->buf=fb->mem->data;
+  fb->refs=1;
+  fb->size=size;
+  fb->stride=stride;
+  fb->width=width;
+  fb->height=height;
+  fb->type=type;
+  if (!initPal(fb,NULL)) {
+    releaseMem(fb->mem);
+    free(fb);
+    return NULL;
+  }
+  sil_addDirtyFB(fb,0,0,width,height);
+  sil_setErr(SILERR_ALLOK);
+  return fb;
+}
+
+/*****************************************************************************
+  Create framebuffer using existing memory, like display memory or a buffer 
+  of another library. Memory isn't copied and won't be freed when 
+  framebuffer is destroyed.
+
+  In: buffer, width & height of framebuffer, number of bytes from start of 
+      one row to the next (0 = no gaps between rows) + RGB format
+
+ *****************************************************************************/
+
+SILFB *sil_wrapFB(BYTE *buf, UINT width, UINT height, UINT stride, BYTE type) {
+  SILFB *fb;
+  UINT rowbytes;
+
+  rowbytes=rowBytes(width,type);
+#ifndef SIL_LIVEDANGEROUS
+  if ((NULL==buf)||(0==width)||(0==height)||(0==rowbytes)) {
+      log_warn("can't wrap framebuffer; wrong or missing parameters");
+      sil_setErr(SILERR_WRONGFORMAT);
+      return NULL;
+  }
+#endif
+  if (0==stride) stride=rowbytes;
+  if (stride<rowbytes) {
+    log_warn("can't wrap framebuffer; rows (%d bytes) don't fit in stride (%d)",rowbytes,stride);
+    sil_setErr(SILERR_WRONGFORMAT);
+    return NULL;
+  }
+
+  fb=calloc(1,sizeof(SILFB));
+  if (NULL==fb) {
+    log_info("ERR: Can't allocate memory for framebuffer struct");
+    sil_setErr(SILERR_NOMEM);
+    return NULL;
+  }
+  fb->buf=buf;
+  fb->refs=1;
+  fb->size=stride*height;
+  fb->stride=stride;
+  fb->width=width;
+  fb->height=height;
+  fb->type=type;
+  if (!initPal(fb,NULL)) {
+    free(fb);
+    return NULL;
+  }
+  sil_addDirtyFB(fb,0,0,width,height);
+  sil_setErr(SILERR_ALLOK);
+  return fb;
+}
+
+/*****************************************************************************
+  Create framebuffer that is a "view" on a rectangle of another framebuffer.
+  No pixels are copied; drawing into one is visible in the other. Memory is
+  kept until both are destroyed, so parent can be destroyed before its views.
+
+  Changed areas and opacity are kept per framebuffer, so when both are 
+  drawn into and used, mark changes with sil_addDirtyFB on the other one.
+  Same for palette (SILTYPE_PAL8), view starts with a copy of it.
+
+  In: parent framebuffer, x,y (top left corner within parent), width & height
+      of rectangle, should be completely within parent. For 444, x should 
+      be even (pixel should start at byte boundary), for A1 a multiple of 8
+
+ *****************************************************************************/
+
+SILFB *sil_subFB(SILFB *parent, UINT x, UINT y, UINT width, UINT height) {
+  SILFB *fb;
+
+#ifndef SIL_LIVEDANGEROUS
+  if ((NULL==parent)||(NULL==parent->buf)||(0==parent->size)) {
+    log_warn("can't create view on non-initialized framebuffer");
+    sil_setErr(SILERR_NOTINIT);
+    return NULL;
+  }
+#endif
+  if ((0==width)||(0==height)||(SILTYPE_EMPTY==parent->type)||
+      (x>=parent->width)||(y>=parent->height)||
+      (width>parent->width-x)||(height>parent->height-y)) {
+    log_warn("can't create view of %dx%d at %d,%d on %dx%d framebuffer",
+      width,height,x,y,parent->width,parent->height);
+    sil_setErr(SILERR_WRONGFORMAT);
+    return NULL;
+  }
+  if ((x%2)&&((SILTYPE_444RGB==parent->type)||(SILTYPE_444BGR==parent->type))) {
+    log_warn("can't create view on 444 framebuffer starting halfway a byte");
+    sil_setErr(SILERR_WRONGFORMAT);
+    return NULL;
+  }
+  if ((x%8)&&(SILTYPE_A1==parent->type)) {
+    log_warn("can't create view on A1 framebuffer starting halfway a byte");
+    sil_setErr(SILERR_WRONGFORMAT);
+    return NULL;
+  }
+
+  /* pixels of view should be the ones of parent, not of a copy */
+  if ((parent->cow)&&(!UnshareFB(parent))) return NULL;
+
+  fb=calloc(1,sizeof(SILFB));
+  if (NULL==fb) {
+    log_info("ERR: Can't allocate memory for framebuffer struct");
+    sil_setErr(SILERR_NOMEM);
+    return NULL;
+  }
+  fb->type=parent->type;
+  if (!initPal(fb,parent->pal)) {
+    free(fb);
+    return NULL;
+  }
+  fb->refs=1;
+  fb->mem=parent->mem;
+  if (fb->mem) fb->mem->refs++;
+  if ((SILTYPE_444RGB==parent->type)||(SILTYPE_444BGR==parent->type)) {
+    fb->buf=parent->buf+y*parent->stride+x*3/2;
+  } else {
+    fb->buf=parent->buf+y*parent->stride+rowBytes(x,parent->type);
+  }
+  fb->stride=parent->stride;
+  fb->size=(height-1)*fb->stride+rowBytes(width,parent->type);
+  fb->width=width;
+  fb->height=height;
+  fb->type=parent->type;
+  sil_addDirtyFB(fb,0,0,width,height);
+  sil_setErr(SILERR_ALLOK);
+  return fb;
+}
+
+/*****************************************************************************
+  Create copy of framebuffer. When possible, pixels aren't copied yet but 
+  shared until either framebuffer is drawn into ("copy-on-write"), so 
+  copying is cheap when copy isn't changed or only used for a different 
+  position. 
+  Note that changing buf directly, without using functions here, will change
+  both copies.
+
+  In: framebuffer to copy
+  Out: new framebuffer or NULL if memory couldn't be allocated
+
+ *****************************************************************************/
+
+SILFB *sil_copyFB(SILFB *fb) {
+  SILFB *ret;
+
+#ifndef SIL_LIVEDANGEROUS
+  if ((NULL==fb)||(NULL==fb->buf)||(0==fb->size)) {
+    log_warn("can't copy non-initialized framebuffer");
+    sil_setErr(SILERR_NOTINIT);
+    return NULL;
+  }
+#endif
+
+  /* only when memory isn't wrapped, isn't a view or used by views */
+  if ((fb->mem)&&(fb->buf==fb->mem->data)&&(fb->size==fb->stride*fb->height)&&
+      ((1==fb->mem->refs)||(fb->cow))) {
+    ret=calloc(1,sizeof(SILFB));
+    if (NULL==ret) {
+      log_info("ERR: Can't allocate memory for framebuffer struct");
+      sil_setErr(SILERR_NOMEM);
+      return NULL;
+    }
+    memcpy(ret,fb,sizeof(SILFB));
+    if (!initPal(ret,fb->pal)) {
+      free(ret);
+      return NULL;
+    }
+    ret->refs=1;
+    ret->dirtycnt=0;
+    ret->mem->refs++;
+    ret->cow=1;
+    fb->cow=1;
+    sil_addDirtyFB(ret,0,0,ret->width,ret->height);
+    sil_setErr(SILERR_ALLOK);
+    return ret;
+  }
+
+  ret=sil_initFB(fb->width,fb->height,fb->type);
+  if (NULL==ret) return NULL;
+  if (fb->pal) memcpy(ret->pal,fb->pal,256*4);
+  if (SILTYPE_EMPTY!=fb->type) {
+    for (UINT y=0;y<fb->height;y++) {
+      memcpy(ret->buf+y*ret->stride,fb->buf+y*fb->stride,rowBytes(fb->width,fb->type));
+    }
+  }
+  sil_setErr(SILERR_ALLOK);
+  return ret;
+}
+
+/*****************************************************************************
+  Internal function: same as sil_wrapFB, but framebuffer takes ownership of 
+  (malloc'ed) memory, like images decoded by lodepng
+
+ *****************************************************************************/
+
+SILFB *AdoptFB(BYTE *buf, UINT width, UINT height, UINT stride, BYTE type) {
+  SILFB *fb;
+
+  fb=sil_wrapFB(buf,width,height,stride,type);
+  if (NULL==fb) return NULL;
+  fb->mem=calloc(1,sizeof(SILMEM));
+  if (NULL==fb->mem) {
+    free(fb);
+    log_info("ERR: Can't allocate memory for framebuffer struct");
+    sil_setErr(SILERR_NOMEM);
+    return NULL;
+  }
+  fb->mem->data=buf;
+  fb->mem->refs=1;
+  return fb;
+}
+
+/*****************************************************************************
+  Internal function: let framebuffer use pixels, dimensions and type of 
+  another (temporary) framebuffer, which will be destroyed. Used when a 
+  framebuffer gets a new size or buffer while keeping the same SILFB, since
+  layers and displays point to it.
+
+ *****************************************************************************/
+
+void ReplaceFB(SILFB *fb, SILFB *with) {
+  releaseMem(fb->mem);
+  free(fb->pal);
+  fb->mem=with->mem;
+  fb->pal=with->pal;
+  fb->cow=with->cow;
+  fb->buf=with->buf;
+  fb->size=with->size;
+  fb->stride=with->stride;
+  fb->width=with->width;
+  fb->height=with->height;
+  fb->type=with->type;
+  fb->opacity=with->opacity;
+  fb->dirtycnt=0;
+  sil_addDirtyFB(fb,0,0,fb->width,fb->height);
+  free(with);
+}
+
+/*****************************************************************************
+
+  Internal functions: determine opacity class of pixels within area of a 
+  framebuffer with alpha channel (ABGR, ARGB or PARGB, alpha is 4th byte,
+  or PAL8, A8 and A1, alpha depends on palette) and update cached opacity 
+  class with areas changed since then
+
+ *****************************************************************************/
+
+static BYTE opacityBox(SILFB *fb, SILBOX *box) {
+  BYTE rgba[SILSPANCHUNK*4];
+  BYTE *buf;
+  UINT cnt;
+  BYTE ret=SILOPACITY_OPAQUE;
+  UINT maxx,maxy;
+
+  /* area might be from before framebuffer has been resized */
+  maxx=SIL_MIN(box->minx+box->width,fb->width);
+  maxy=SIL_MIN(box->miny+box->height,fb->height);
+  if (NULL!=fb->pal) {
+    /* alpha depends on palette, use spans for those */
+    for (UINT y=box->miny;y<maxy;y++) {
+      for (UINT x=box->minx;x<maxx;x+=cnt) {
+        cnt=SIL_MIN(maxx-x,SILSPANCHUNK);
+        FBToSpan(fb,x,y,cnt,rgba);
+        for (UINT i=0;i<cnt;i++) {
+          if (255==rgba[i*4+3]) continue;
+          if (rgba[i*4+3]) return SILOPACITY_ALPHA;
+          ret=SILOPACITY_BINARY;
+        }
+      }
+    }
+    return ret;
+  }
+  for (UINT y=box->miny;y<maxy;y++) {
+    buf=fb->buf+y*fb->stride+box->minx*4+3;
+    for (UINT x=box->minx;x<maxx;x++,buf+=4) {
+      if (255==*buf) continue;
+      if (*buf) return SILOPACITY_ALPHA;
+      ret=SILOPACITY_BINARY;
+    }
+  }
+  return ret;
+}
+
+static void updateOpacity(SILFB *fb) {
+  SILBOX all;
+  SILBOX *box;
+  BYTE opacity;
+
+  /* changes can only make it worse, so only changed areas need checking,  */
+  /* unless everything has been redrawn                                    */
+  if (SILOPACITY_UNKNOWN!=fb->opacity) {
+    if ((SILOPACITY_ALPHA==fb->opacity)||(0==fb->dirtycnt)) return;
+    opacity=fb->opacity;
+    for (UINT i=0;i<fb->dirtycnt;i++) {
+      box=&fb->dirty[i];
+      if ((0==box->minx)&&(0==box->miny)&&(fb->width==box->width)&&(fb->height==box->height)) {
+        opacity=SILOPACITY_UNKNOWN;
+        break;
+      }
+      opacity=SIL_MAX(opacity,opacityBox(fb,box));
+    }
+    if (SILOPACITY_UNKNOWN!=opacity) {
+      fb->opacity=opacity;
+      return;
+    }
+  }
+  all.minx=0;
+  all.miny=0;
+  all.width=fb->width;
+  all.height=fb->height;
+  fb->opacity=opacityBox(fb,&all);
+}
+
+/*****************************************************************************
+
+  Internal functions: span functions (see pixel.h) and number of bytes per
+  pixel for every type, NULL / 0 for types that aren't stored as bitfields.
+  Used to select the right function once, instead of for every pixel.
+
+ *****************************************************************************/
+
+#define SILPIXEL_PUTENTRY(NAME,BYTES,...) [SILTYPE_##NAME]=sil_putSpan_##NAME,
+#define SILPIXEL_GETENTRY(NAME,BYTES,...) [SILTYPE_##NAME]=sil_getSpan_##NAME,
+#define SILPIXEL_BYTESENTRY(NAME,BYTES,...) [SILTYPE_##NAME]=BYTES,
+
+static const SILSPANFUNC putSpans[SILTYPE_A1+1]={ SILPIXEL_TYPES(SILPIXEL_PUTENTRY) };
+static const SILSPANFUNC getSpans[SILTYPE_A1+1]={ SILPIXEL_TYPES(SILPIXEL_GETENTRY) };
+static const BYTE spanBytes[SILTYPE_A1+1]={ SILPIXEL_TYPES(SILPIXEL_BYTESENTRY) };
+
+SILSPANFUNC PutSpanFunc(BYTE type) {
+  return (type<=SILTYPE_A1)?putSpans[type]:NULL;
+}
+
+SILSPANFUNC GetSpanFunc(BYTE type) {
+  return (type<=SILTYPE_A1)?getSpans[type]:NULL;
+}
+
+/*****************************************************************************
+  Internal functions: write or read a span of pixels, without any checks on
+  the framebuffer, without keeping track of changed areas and without
+  setting error codes. Used by the sil_putSpanFB / sil_getSpanFB functions
+  and by the compositor, which can run in multiple threads at once.
+
+ *****************************************************************************/
+
+void SpanToFB(SILFB *fb, UINT x, UINT y, UINT n, BYTE *rgba) {
+  BYTE *buf=NULL;
+  UINT pos=0;
+
+  /* don't bother drawing outside of buffer area */
+  if ((x>=fb->width)||(y>=fb->height)||(0==n)) {
+    return;
+  }
+  if ((fb->cow)&&(!UnshareFB(fb))) return;
+  if (n>fb->width-x) n=fb->width-x;
+
+  if ((fb->type<=SILTYPE_A1)&&(putSpans[fb->type])) {
+    putSpans[fb->type](fb->buf+y*fb->stride+x*spanBytes[fb->type],rgba,n);
+    return;
+  }
+  switch(fb->type) {
+    case SILTYPE_EMPTY:
+      /* don't do anything */
+      break;
+    case SILTYPE_444BGR:
+      /* two pixels share 3 bytes, so keep the nibble of the other pixel */
+      pos=x;
+      for (UINT i=0;i<n;i++,pos++,rgba+=4) {
+        buf=fb->buf+y*fb->stride+(pos*3+1)/2;
+        if (pos&1) {
+          buf[0]=(rgba[0]&0xF0)|(rgba[1]>>4);
+          buf[1]=(buf[1]&0x0F)|(rgba[2]&0xF0);
+        } else {
+          buf[0]=(buf[0]&0xF0)|(rgba[0]>>4);
+          buf[1]=(rgba[1]&0xF0)|(rgba[2]>>4);
+        }
+      }
       break;
     case SILTYPE_444RGB:
+      pos=x;
+      for (UINT i=0;i<n;i++,pos++,rgba+=4) {
+        buf=fb->buf+y*fb->stride+(pos*3+1)/2;
+        if (pos&1) {
+          buf[0]=(rgba[2]&0xF0)|(rgba[1]>>4);
+          buf[1]=(buf[1]&0x0F)|(rgba[0]&0xF0);
+        } else {
+          buf[0]=(buf[0]&0xF0)|(rgba[2]>>4);
+          buf[1]=(rgba[1]&0xF0)|(rgba[0]>>4);
+        }
+      }
+      break;
+    case SILTYPE_PARGB:
+      buf=fb->buf+y*fb->stride+x*4;
+      for (UINT i=0;i<n;i++,rgba+=4,buf+=4) {
+        buf[0]=sil_mul255(rgba[2],rgba[3]);
+        buf[1]=sil_mul255(rgba[1],rgba[3]);
+        buf[2]=sil_mul255(rgba[0],rgba[3]);
+        buf[3]=rgba[3];
+      }
+      break;
+    case SILTYPE_PAL8:
+      /* search palette only once for runs of the same color */
+      buf=fb->buf+y*fb->stride+x;
+      for (UINT i=0;i<n;i++,rgba+=4) {
+        if ((0==i)||(memcmp(rgba,rgba-4,4))) pos=palIndex(fb->pal,rgba);
+        *buf++=pos;
+      }
+      break;
+    case SILTYPE_A8:
+      buf=fb->buf+y*fb->stride+x;
+      for (UINT i=0;i<n;i++,rgba+=4) {
+        *buf++=rgba[3];
+      }
+      break;
+    case SILTYPE_A1:
+      pos=x;
+      for (UINT i=0;i<n;i++,pos++,rgba+=4) {
+        buf=fb->buf+y*fb->stride+pos/8;
+        if (rgba[3]&0x80) {
+          *buf|=0x80>>(pos%8);
+        } else {
+          *buf&=~(0x80>>(pos%8));
+        }
+      }
+      break;
+  }
+}
+
+void FBToSpan(SILFB *fb, UINT x, UINT y, UINT n, BYTE *rgba) {
+  BYTE *buf=NULL;
+  UINT pos=0;
+  UINT cnt=0;
+
+  /* don't get pixels outside of buffer area */
+  if ((x<fb->width)&&(y<fb->height)) cnt=SIL_MIN(n,fb->width-x);
+  if (cnt<n) memset(rgba+cnt*4,0,(n-cnt)*4);
+
+  if ((fb->type<=SILTYPE_A1)&&(getSpans[fb->type])) {
+    getSpans[fb->type](fb->buf+y*fb->stride+x*spanBytes[fb->type],rgba,cnt);
+    return;
+  }
+  switch(fb->type) {
+    case SILTYPE_EMPTY:
+      memset(rgba,0,cnt*4);
+      break;
     case SILTYPE_444BGR:
-      size=1+width*height*1.5;
+      pos=x;
+      for (UINT i=0;i<cnt;i++,pos++,rgba+=4) {
+        buf=fb->buf+y*fb->stride+(pos*3+1)/2;
+        if (pos&1) {
+          rgba[0]=  buf[0]&0xF0;
+          rgba[1]= (buf[0]&0x0F)<<4;
+          rgba[2]=  buf[1]&0xF0;
+        } else {
+          rgba[0]= (buf[0]&0x0F)<<4;
+          rgba[1]=  buf[1]&0xF0;
+          rgba[2]= (buf[1]&0x0F)<<4;
+        }
+        rgba[3]=255;
+      }
+      break;
+    case SILTYPE_444RGB:
+      pos=x;
+      for (UINT i=0;i<cnt;i++,pos++,rgba+=4) {
+        buf=fb->buf+y*fb->stride+(pos*3+1)/2;
+        if (pos&1) {
+          rgba[2]=  buf[0]&0xF0;
+          rgba[1]= (buf[0]&0x0F)<<4;
+          rgba[0]=  buf[1]&0xF0;
+        } else {
+          rgba[2]= (buf[0]&0x0F)<<4;
+          rgba[1]=  buf[1]&0xF0;
+          rgba[0]= (buf[1]&0x0F)<<4;
+        }
+        rgba[3]=255;
+      }
+      break;
+    case SILTYPE_PARGB:
+      buf=fb->buf+y*fb->stride+x*4;
+      for (UINT i=0;i<cnt;i++,rgba+=4,buf+=4) {
+        rgba[3]=buf[3];
+        if ((255==buf[3])||(0==buf[3])) {
+          rgba[0]=buf[2];
+          rgba[1]=buf[1];
+          rgba[2]=buf[0];
+        } else {
+          /* undo premultiplying, with rounding */
+          rgba[0]=SIL_MIN(255,(buf[2]*255+buf[3]/2)/buf[3]);
+          rgba[1]=SIL_MIN(255,(buf[1]*255+buf[3]/2)/buf[3]);
+          rgba[2]=SIL_MIN(255,(buf[0]*255+buf[3]/2)/buf[3]);
+        }
+      }
       break;
-    case SILTYPE_555RGB:
-    case SILTYPE_565RGB:
-    case SILTYPE_555BGR:
-    case SILTYPE_565BGR:
-      size=width*height*2;
+    case SILTYPE_PAL8:
+      buf=fb->buf+y*fb->stride+x;
+      for (UINT i=0;i<cnt;i++,rgba+=4) {
+        memcpy(rgba,fb->pal+(*buf++)*4,4);
+      }
       break;
-    case SILTYPE_666RGB:
-    case SILTYPE_666BGR:
-    case SILTYPE_888RGB:
-    case SILTYPE_888BGR:
-      size=width*height*3;
+    case SILTYPE_A8:
+      sil_expandSpan(rgba,fb->buf+y*fb->stride+x,cnt,fb->pal);
       break;
-    case SILTYPE_ABGR:
-    case SILTYPE_ARGB:
-      size=width*height*4;
+    case SILTYPE_A1:
+      pos=x;
+      for (UINT i=0;i<cnt;i++,pos++,rgba+=4) {
+        memcpy(rgba,fb->pal,3);
+        rgba[3]=(fb->buf[y*fb->stride+pos/8]&(0x80>>(pos%8)))?fb->pal[3]:0;
+      }
       break;
+  }
+}
 
-    case SILTYPE_EMPTY:
-      size=1;
-    default:
-      /* unknown type */
-      log_info("ERR: Unknown RGB format given to greate framebuffer: %d",type);
-      break;
+/*****************************************************************************
+
+  Internal functions: same as SpanToFB and FBToSpan, but colors of span are
+  premultiplied with alpha. For SILTYPE_PARGB these are used as is, for 
+  other types colors are converted (PreSpanToFB changes given span).
+  Used for blending and filtering premultiplied layers.
+
+ *****************************************************************************/
+
+void PreSpanToFB(SILFB *fb, UINT x, UINT y, UINT n, BYTE *rgba) {
+  BYTE *buf;
+  BYTE *p;
+
+  if (SILTYPE_PARGB!=fb->type) {
+    p=rgba;
+    for (UINT i=0;i<n;i++,p+=4) {
+      if ((255==p[3])||(0==p[3])) continue;
+      p[0]=SIL_MIN(255,(p[0]*255+p[3]/2)/p[3]);
+      p[1]=SIL_MIN(255,(p[1]*255+p[3]/2)/p[3]);
+      p[2]=SIL_MIN(255,(p[2]*255+p[3]/2)/p[3]);
+    }
+    SpanToFB(fb,x,y,n,rgba);
+    return;
   }
-  if (0==size) {
-    sil_setErr(SILERR_WRONGFORMAT);
-    return NULL;
+
+  if ((x>=fb->width)||(y>=fb->height)||(0==n)) return;
+  if ((fb->cow)&&(!UnshareFB(fb))) return;
+  if (n>fb->width-x) n=fb->width-x;
+  buf=fb->buf+y*fb->stride+x*4;
+  for (UINT i=0;i<n;i++,rgba+=4,buf+=4) {
+    buf[0]=rgba[2];
+    buf[1]=rgba[1];
+    buf[2]=rgba[0];
+    buf[3]=rgba[3];
   }
+}
 
-  fb=calloc(1,sizeof(SILFB));
-  if (NULL==fb) {
-    log_info("ERR: Can't allocate memory for framebuffer struct");
-    sil_setErr(SILERR_NOMEM);
-    return NULL;
+void FBToPreSpan(SILFB *fb, UINT x, UINT y, UINT n, BYTE *rgba) {
+  BYTE *buf;
+  UINT cnt=0;
+
+  if (SILTYPE_PARGB!=fb->type) {
+    FBToSpan(fb,x,y,n,rgba);
+    for (UINT i=0;i<n;i++,rgba+=4) {
+      if (255==rgba[3]) continue;
+      rgba[0]=sil_mul255(rgba[0],rgba[3]);
+      rgba[1]=sil_mul255(rgba[1],rgba[3]);
+      rgba[2]=sil_mul255(rgba[2],rgba[3]);
+    }
+    return;
   }
 
-  fb->buf=calloc(1,size);
-  if (NULL==fb->buf) {
-    free(fb);
-    log_info("ERR: Can't allocate memory for buffer of framebuffer");
-    sil_setErr(SILERR_NOMEM);
-    return NULL;
+  if ((x<fb->width)&&(y<fb->height)) cnt=SIL_MIN(n,fb->width-x);
+  if (cnt<n) memset(rgba+cnt*4,0,(n-cnt)*4);
+  buf=fb->buf+y*fb->stride+x*4;
+  for (UINT i=0;i<cnt;i++,rgba+=4,buf+=4) {
+    rgba[0]=buf[2];
+    rgba[1]=buf[1];
+    rgba[2]=buf[0];
+    rgba[3]=buf[3];
   }
-  fb->size=size;
-  fb->width=width;
-  fb->height=height;
-  fb->type=type;
-  fb->changed=1;
-  sil_setErr(SILERR_ALLOK);
-  return fb;
 }
 
 /*****************************************************************************
-  draws a pixel in FB, 
+  draws a row ("span") of pixels in FB, starting at x,y going right.
   For speed purposes, it just overwrites all color and alpha data and therefore 
-  doesn't do blending on its own with existing/previous pixels. 
+  doesn't do blending on its own with existing/previous pixels. Type of 
+  framebuffer is only checked once per span, so use this instead of 
+  sil_putPixelFB when drawing multiple pixels on a row.
 
   Alhtough colors & alpha are given as full-byte values, it might be downscaled
   to lower colordepth with or without alpha, depending on framebuffer type
+  Pixels outside of framebuffer are ignored.
 
-  In: x,y (left corner of Framebuffer is 0,0) , BYTE red/green/blue/alpha values
+  In: x,y (left corner of Framebuffer is 0,0), number of pixels, 
+      array with 4 bytes per pixel; red,green,blue,alpha 
       Alpha starts from 0 (full-transparent) till 255 (no transparency)      
 
  *****************************************************************************/
 
-void sil_putPixelFB(SILFB *fb,UINT x,UINT y,BYTE red, BYTE green, BYTE blue, BYTE alpha) {
-  int pos=0;
-  BYTE *buf=NULL;
-  UINT width=0;
-  UINT height=0;
+void sil_putSpanFB(SILFB *fb, UINT x, UINT y, UINT n, BYTE *rgba) {
+  SILBOX *box;
 
 #ifndef SIL_LIVEDANGEROUS
   if (NULL==fb) {
-    log_warn("trying to putpixel on non-initialized FB ");
+    log_warn("trying to putspan on non-initialized FB ");
     sil_setErr(SILERR_NOTINIT);
     return;
   }
-  if (NULL==fb->buf) {
-    log_warn("trying to a non-allocated FB buffer ");
+  if ((NULL==fb->buf)||(NULL==rgba)) {
+    log_warn("trying to putspan on non-allocated FB buffer ");
     sil_setErr(SILERR_NOTINIT);
     return;
   }
   if (0==fb->size) {
-    log_warn("trying to putpixel on zero size size FB buffer ");
+    log_warn("trying to putspan on zero size size FB buffer ");
     sil_setErr(SILERR_NOTINIT);
     return;
   }
 #endif
 
   /* don't bother drawing outside of buffer area */
-  if ((x>=fb->width)||(y>=fb->height)) {
+  if ((x>=fb->width)||(y>=fb->height)||(0==n)) {
     return;
   }
+  if (n>fb->width-x) n=fb->width-x;
+  SpanToFB(fb,x,y,n,rgba);
+  if (SILOPACITY_ALPHA==fb->opacity) fb->opacity=SILOPACITY_UNKNOWN;
 
-  buf=fb->buf;
-  width=fb->width;
-  height=fb->height;
+  /* most drawing continues within or next to last changed area, check that */
+  /* one first to keep it cheap                                              */
+  if (fb->dirtycnt) {
+    box=&fb->dirty[fb->dirtycnt-1];
+    if ((x-box->minx<box->width)&&(x+n-box->minx<=box->width)&&
+        (y-box->miny<box->height)) {
+      sil_setErr(SILERR_ALLOK);
+      return;
+    }
+  }
+  sil_addDirtyFB(fb,x,y,n,1);
+  sil_setErr(SILERR_ALLOK);
+}
 
-  switch(fb->type) {
-    case SILTYPE_EMPTY:
-      /* don't do anything */
-      break;
-    case SILTYPE_332RGB:  
-      buf[x+width*y]=(red&0xE0)|((green&0xE0)>>3)|(blue>>6);
-      break;
-    case SILTYPE_332BGR:  
-      buf[x+width*y]=(blue&0xE0)|((green&0xE0)>>3)|(red>>6);
-      break;
-    case SILTYPE_444BGR:
-      pos=x*1.5+width*y*1.5;
-      if ((x+width*y)%2) {
-        buf[pos]=red&0xF0|((green&0xF0)>>4);
-        buf[pos+1]|=blue&0xF0;
-      } else {
-        buf[pos]|=((red&0xF0)>>4);
-        buf[pos+1]=(green&0xF0)|((blue&0xF0)>>4);
-      }
-      break;
-    case SILTYPE_444RGB:
-      pos=x*1.5+width*y*1.5;
-      if ((x+width*y)%2) {
-        buf[pos]=blue&0xF0|((green&0xF0)>>4);
-        buf[pos+1]|=red&0xF0;
-      } else {
-        buf[pos]|=((blue&0xF0)>>4);
-        buf[pos+1]=(green&0xF0)|((red&0xF0)>>4);
-      }
-      break;
-    case SILTYPE_555BGR: 
-      buf[x*2+1+width*y*2]= (red  &0xF8)    |((green&0xE0)>>5);
-      buf[x*2+  width*y*2]=((green&0x18)<<3)|((blue &0xF8)>>2);
-      break;
-    case SILTYPE_555RGB: 
-      buf[x*2+1+width*y*2]= (blue &0xF8)    |((green&0xE0)>>5);
-      buf[x*2+  width*y*2]=((green&0x18)<<3)|((red  &0xF8)>>2);
-      break;
-    case SILTYPE_565BGR: 
-      buf[x*2+1+width*y*2]= (red  &0xF8)    |((green&0xE0)>>5);
-      buf[x*2+  width*y*2]=((green&0x1C)<<3)| (blue>>3);
-      break;
-    case SILTYPE_565RGB: 
-      buf[x*2+1+width*y*2]= (blue &0xF8)    |((green&0xE0)>>5);
-      buf[x*2+  width*y*2]=((green&0x1C)<<3)| (red >>3);
-      break;
-    case SILTYPE_666BGR:
-      buf[x*3+  width*3*y]=red>>2;
-      buf[x*3+1+width*3*y]=green>>2;
-      buf[x*3+2+width*3*y]=blue>>2;
-      break;
-    case SILTYPE_666RGB:
-      buf[x*3+  width*3*y]=blue>>2;
-      buf[x*3+1+width*3*y]=green>>2;
-      buf[x*3+2+width*3*y]=red>>2;
-      break;
-    case SILTYPE_888BGR:
-      buf[x*3+  width*3*y]=red;
-      buf[x*3+1+width*3*y]=green;
-      buf[x*3+2+width*3*y]=blue;
-      break;
-    case SILTYPE_888RGB:
-      buf[x*3+  width*3*y]=blue;
-      buf[x*3+1+width*3*y]=green;
-      buf[x*3+2+width*3*y]=red;
-      break;
-    case SILTYPE_ABGR:
-      buf[x*4+  y*width*4]=red;
-      buf[x*4+1+y*width*4]=green;
-      buf[x*4+2+y*width*4]=blue;
-      buf[x*4+3+y*width*4]=alpha;
-      break;
-    case SILTYPE_ARGB:
-      buf[x*4+  y*width*4]=blue;
-      buf[x*4+1+y*width*4]=green;
-      buf[x*4+2+y*width*4]=red;
-      buf[x*4+3+y*width*4]=alpha;
-      break;
+/*****************************************************************************
+
+  get a row ("span") of pixels from FB, starting at x,y going right.
+
+  Although colors & alpha are given as full-byte values, it might be upscaled
+  from lower colordepth, depending on framebuffer type. Types without alpha
+  will return 255 as alpha value.
+  Will return 0,0,0,0 for pixels outside of framebuffer area
+
+  In: x,y (left corner of Framebuffer is 0,0), number of pixels, 
+      array to store 4 bytes per pixel; red,green,blue,alpha
+
+ *****************************************************************************/
+
+void sil_getSpanFB(SILFB *fb, UINT x, UINT y, UINT n, BYTE *rgba) {
+
+#ifndef SIL_LIVEDANGEROUS
+  if (NULL==fb) {
+    log_warn("trying to getspan an non-initialized FB ");
+    sil_setErr(SILERR_NOTINIT);
+    return;
   }
-  fb->changed=1;
+  if ((0==fb->size)||(NULL==fb->buf)||(NULL==rgba)) {
+    log_warn("trying to getspan an zero size or non-allocated FB buffer ");
+    sil_setErr(SILERR_NOTINIT);
+    return;
+  }
+#endif
+
+  FBToSpan(fb,x,y,n,rgba);
   sil_setErr(SILERR_ALLOK);
 }
 
+/*****************************************************************************
+  draws a pixel in FB, 
+  For speed purposes, it just overwrites all color and alpha data and therefore 
+  doesn't do blending on its own with existing/previous pixels. 
+
+  Alhtough colors & alpha are given as full-byte values, it might be downscaled
+  to lower colordepth with or without alpha, depending on framebuffer type
+
+  In: x,y (left corner of Framebuffer is 0,0) , BYTE red/green/blue/alpha values
+      Alpha starts from 0 (full-transparent) till 255 (no transparency)      
+
+ *****************************************************************************/
+
+void sil_putPixelFB(SILFB *fb,UINT x,UINT y,BYTE red, BYTE green, BYTE blue, BYTE alpha) {
+  BYTE rgba[4];
+
+  rgba[0]=red;
+  rgba[1]=green;
+  rgba[2]=blue;
+  rgba[3]=alpha;
+  sil_putSpanFB(fb,x,y,1,rgba);
+}
+
 /*****************************************************************************
 
   get pixel values from FB, 
@@ -256,140 +997,75 @@ void sil_putPixelFB(SILFB *fb,UINT x,UINT y,BYTE red, BYTE green, BYTE blue, BYT
  *****************************************************************************/
 
 void sil_getPixelFB(SILFB *fb,UINT x,UINT y, BYTE *red, BYTE *green, BYTE *blue, BYTE *alpha) {
-  BYTE val1, val2;
-  BYTE *buf=NULL;
-  UINT width=0;
-  UINT height=0;
-  int pos=0;
+  BYTE rgba[4]={0,0,0,0};
+
+  sil_getSpanFB(fb,x,y,1,rgba);
+  *red  =rgba[0];
+  *green=rgba[1];
+  *blue =rgba[2];
+  *alpha=rgba[3];
+}
+
+/*****************************************************************************
+
+  Set color of palette entry of SILTYPE_PAL8 framebuffer. All pixels using
+  that entry will change color, so it is a cheap way to animate them 
+  (cycling colors, fading, blinking). For SILTYPE_A8 and SILTYPE_A1, entry
+  0 is color of all pixels, its alpha is multiplied with alpha of pixels.
+
+  In: SILFB framebuffer context, index in palette (0-255), BYTE 
+      red/green/blue/alpha values
+
+ *****************************************************************************/
+
+void sil_setPaletteFB(SILFB *fb, BYTE index, BYTE red, BYTE green, BYTE blue, BYTE alpha) {
+  BYTE *p;
 
 #ifndef SIL_LIVEDANGEROUS
-  if (NULL==fb) {
-    log_warn("trying to getpixel an non-initialized FB ");
-    sil_setErr(SILERR_NOTINIT);
+  if ((NULL==fb)||(NULL==fb->pal)) {
+    log_warn("trying to set palette of framebuffer without palette");
+    sil_setErr(SILERR_WRONGFORMAT);
     return;
   }
-  if ((0==fb->size)||(NULL==fb->buf)) {
-    log_warn("trying to getpixel an zero size or non-allocated FB buffer ");
-    sil_setErr(SILERR_NOTINIT);
+#endif
+
+  p=fb->pal+index*4;
+  if ((p[0]==red)&&(p[1]==green)&&(p[2]==blue)&&(p[3]==alpha)) {
+    sil_setErr(SILERR_ALLOK);
     return;
   }
+  p[0]=red;
+  p[1]=green;
+  p[2]=blue;
+  p[3]=alpha;
+  fb->opacity=SILOPACITY_UNKNOWN;
+  sil_addDirtyFB(fb,0,0,fb->width,fb->height);
+  sil_setErr(SILERR_ALLOK);
+}
+
+/*****************************************************************************
+
+  Get color of palette entry of SILTYPE_PAL8 framebuffer
 
-  /* don't get pixel outside of buffer area */
-  if ((x>=fb->width)||(y>=fb->height)) {
-    red=0;
-    green=0;
-    blue=0;
-    alpha=0;
+  In: SILFB framebuffer context, index in palette (0-255), pointers to BYTE
+      red/green/blue/alpha values
+
+ *****************************************************************************/
+
+void sil_getPaletteFB(SILFB *fb, BYTE index, BYTE *red, BYTE *green, BYTE *blue, BYTE *alpha) {
+
+#ifndef SIL_LIVEDANGEROUS
+  if ((NULL==fb)||(NULL==fb->pal)) {
+    log_warn("trying to get palette of framebuffer without palette");
+    sil_setErr(SILERR_WRONGFORMAT);
     return;
   }
 #endif
 
-  buf=fb->buf;
-  width=fb->width;
-  height=fb->height;
-  *alpha=255;
-  switch(fb->type) {
-    case SILTYPE_EMPTY:
-      *blue =0;
-      *green=0;
-      *red  =0;
-      *alpha=0;
-      break;
-    case SILTYPE_332RGB: 
-      *red   = (buf[x+width*y]   )&0xE0;
-      *green = (buf[x+width*y]<<3)&0xE0;
-      *blue  = (buf[x+width*y]<<6)&0xC0;
-      break;
-    case SILTYPE_332BGR: 
-      *blue  = (buf[x+width*y]   )&0xE0;
-      *green = (buf[x+width*y]<<3)&0xE0;
-      *red   = (buf[x+width*y]<<6)&0xC0;
-      break;
-    case SILTYPE_444RGB:
-      pos=x*1.5+width*y*1.5;
-      if ((x+width*y)%2) {
-        *red   =  (buf[pos]  )&0xF0;
-        *green = ((buf[pos]  )&0x0F)<<4;
-        *blue  =  (buf[pos+1])&0xF0;
-      } else {
-        *red   = ((buf[pos]  )&0x0F)<<4;
-        *green =  (buf[pos+1])&0xF0;
-        *blue  = ((buf[pos+1])&0x0F)<<4;
-      }
-      break;
-    case SILTYPE_444BGR:
-      pos=x*1.5+width*y*1.5;
-      if ((x+width*y)%2) {
-        *blue  =  (buf[pos]  )&0xF0;
-        *green = ((buf[pos]  )&0x0F)<<4;
-        *red   =  (buf[pos+1])&0xF0;
-      } else {
-        *blue  = ((buf[pos]  )&0x0F)<<4;
-        *green =  (buf[pos+1])&0xF0;
-        *red   = ((buf[pos+1])&0x0F)<<4;
-      }
-      break;
-    case SILTYPE_555RGB: 
-      val2=buf[x*2+  width*y*2];
-      val1=buf[x*2+1+width*y*2];
-      *red  =   val1 & 0xF8;
-      *green= ((val1 & 0x07)<<5)|((val2 & 0xC0)>>3);
-      *blue =  (val2 & 0x3E)<<2;
-      break;
-    case SILTYPE_555BGR: 
-      val2=buf[x*2+  width*y*2];
-      val1=buf[x*2+1+width*y*2];
-      *blue =   val1 & 0xF8;
-      *green= ((val1 & 0x07)<<5)|((val2 & 0xC0)>>3);
-      *red  =  (val2 & 0x3E)<<2;
-      break;
-    case SILTYPE_565BGR: 
-      val2=buf[x*2+  width*y*2];
-      val1=buf[x*2+1+width*y*2];
-      *red  =   val1 & 0xF8;
-      *green= ((val1 & 0x07)<<5)|((val2 & 0xE0)>>3);
-      *blue =  (val2 & 0x1F)<<3;
-      break;
-    case SILTYPE_565RGB: 
-      val2=buf[x*2+  width*y*2];
-      val1=buf[x*2+1+width*y*2];
-      *blue =   val1 & 0xF8;
-      *green= ((val1 & 0x07)<<5)|((val2 & 0xE0)>>3);
-      *red  =  (val2 & 0x1F)<<3;
-      break;
-    case SILTYPE_666RGB:
-      *red  =buf[x*3+  width*y*3]<<2;
-      *green=buf[x*3+1+width*y*3]<<2;
-      *blue =buf[x*3+2+width*y*3]<<2;
-      break;
-    case SILTYPE_666BGR:
-      *blue =buf[x*3+  width*y*3]<<2;
-      *green=buf[x*3+1+width*y*3]<<2;
-      *red  =buf[x*3+2+width*y*3]<<2;
-      break;
-    case SILTYPE_888RGB:
-      *red  =buf[x*3+  width*y*3];
-      *green=buf[x*3+1+width*y*3];
-      *blue =buf[x*3+2+width*y*3];
-      break;
-    case SILTYPE_888BGR:
-      *blue =buf[x*3+  width*y*3];
-      *green=buf[x*3+1+width*y*3];
-      *red  =buf[x*3+2+width*y*3];
-      break;
-    case SILTYPE_ABGR:
-      *red  =buf[x*4+  width*y*4];
-      *green=buf[x*4+1+width*y*4];
-      *blue =buf[x*4+2+width*y*4];
-      *alpha=buf[x*4+3+width*y*4];
-      break;
-    case SILTYPE_ARGB:
-      *blue =buf[x*4+  width*y*4];
-      *green=buf[x*4+1+width*y*4];
-      *red  =buf[x*4+2+width*y*4];
-      *alpha=buf[x*4+3+width*y*4];
-      break;
-  }
+  *red  =fb->pal[index*4];
+  *green=fb->pal[index*4+1];
+  *blue =fb->pal[index*4+2];
+  *alpha=fb->pal[index*4+3];
   sil_setErr(SILERR_ALLOK);
 }
 
@@ -403,9 +1079,28 @@ void sil_getPixelFB(SILFB *fb,UINT x,UINT y, BYTE *red, BYTE *green, BYTE *blue,
  *****************************************************************************/
 
 void sil_clearFB(SILFB *fb) {
+  BYTE zero[SILSPANCHUNK*4];
+
   /* size is used to check for initialization of variables inside FB context */
   if ((fb)&&(fb->size)) {
-    memset(fb->buf,0,fb->size);
+    if ((fb->cow)&&(!UnshareFB(fb))) return;
+    if (fb->size==fb->stride*fb->height) {
+      memset(fb->buf,0,fb->size);
+    } else if ((SILTYPE_444RGB==fb->type)||(SILTYPE_444BGR==fb->type)||(SILTYPE_A1==fb->type)) {
+      /* view on other framebuffer, bytes are shared with pixels next to it */
+      memset(zero,0,sizeof(zero));
+      for (UINT y=0;y<fb->height;y++) {
+        for (UINT x=0;x<fb->width;x+=SILSPANCHUNK) {
+          SpanToFB(fb,x,y,SIL_MIN(fb->width-x,SILSPANCHUNK),zero);
+        }
+      }
+    } else {
+      /* view on other framebuffer, don't touch pixels next to it */
+      for (UINT y=0;y<fb->height;y++) {
+        memset(fb->buf+y*fb->stride,0,rowBytes(fb->width,fb->type));
+      }
+    }
+    sil_addDirtyFB(fb,0,0,fb->width,fb->height);
     sil_setErr(SILERR_ALLOK);
   } else {
     log_warn("trying to clear a non-initialized FB ");
@@ -416,21 +1111,31 @@ void sil_clearFB(SILFB *fb) {
 /*****************************************************************************
   
   Destroy Framebuffer by releasing allocated memory for framebuffer struct and
-  accompanied buffer inside.
+  accompanied buffer inside (unless views on it, see sil_subFB, or copies 
+  still use it). When framebuffer is shared by multiple layers (refs), only 
+  the last one will really destroy it.
 
   In: SILFB Framebuffer context
 
  *****************************************************************************/
 
 void sil_destroyFB(SILFB *fb) {
+  if ((fb)&&(fb->refs>1)) {
+    /* still used by other layers */
+    fb->refs--;
+    sil_setErr(SILERR_ALLOK);
+    return;
+  }
   if (fb) {
     if (fb->size && fb->buf) {
-      free(fb->buf);
+      /* views on it might still use memory */
+      releaseMem(fb->mem);
       sil_setErr(SILERR_ALLOK);
     } else {
       log_warn("trying to destroy an empty FB buffer ");
       sil_setErr(SILERR_NOTINIT);
     }
+    free(fb->pal);
     free(fb);
     fb=NULL;
   } else {
@@ -438,3 +1143,193 @@ void sil_destroyFB(SILFB *fb) {
     sil_setErr(SILERR_NOTINIT);
   }
 }
+
+/*****************************************************************************
+  
+  Add area to a list of areas (boxes). Overlapping or touching areas are 
+  merged into one, and when list is full, area is merged with the one that 
+  grows the least. Used for keeping track of changed parts of framebuffers 
+  and display.
+
+  In: list of boxes, pointer to number of boxes in use, maximum size of list,
+      x,y,width and height of area to add
+
+ *****************************************************************************/
+
+void sil_addBox(SILBOX *list, UINT *cnt, UINT max, UINT x, UINT y, UINT width, UINT height) {
+  SILBOX *box;
+  UINT best=0;
+  unsigned long long growth,bestgrowth;
+  UINT minx,miny,maxx,maxy;
+
+  if ((0==width)||(0==height)||(0==max)) return;
+
+  /* prevent overflow of right or bottom side */
+  if (width>~0U-x) width=~0U-x;
+  if (height>~0U-y) height=~0U-y;
+
+  do {
+    /* merge with the first area that overlaps or touches the new one */
+    for (UINT i=0;i<*cnt;i++) {
+      box=&list[i];
+      if ((x<=box->minx+box->width)&&(box->minx<=x+width)&&
+          (y<=box->miny+box->height)&&(box->miny<=y+height)) {
+        best=i+1;
+        break;
+      }
+    }
+    if ((0==best)&&(*cnt>=max)) {
+      /* no room left, find area that grows the least when merged */
+      bestgrowth=~0ULL;
+      for (UINT i=0;i<*cnt;i++) {
+        box=&list[i];
+        minx=SIL_MIN(x,box->minx);
+        miny=SIL_MIN(y,box->miny);
+        maxx=SIL_MAX(x+width,box->minx+box->width);
+        maxy=SIL_MAX(y+height,box->miny+box->height);
+        growth=(unsigned long long)(maxx-minx)*(maxy-miny)-
+               (unsigned long long)box->width*box->height;
+        if (growth<bestgrowth) {
+          bestgrowth=growth;
+          best=i+1;
+        }
+      }
+    }
+    if (best) {
+      /* take the area out of the list and retry with the merged result, */
+      /* it might overlap other areas now                                */
+      box=&list[best-1];
+      minx=SIL_MIN(x,box->minx);
+      miny=SIL_MIN(y,box->miny);
+      maxx=SIL_MAX(x+width,box->minx+box->width);
+      maxy=SIL_MAX(y+height,box->miny+box->height);
+      x=minx;
+      y=miny;
+      width=maxx-minx;
+      height=maxy-miny;
+      list[best-1]=list[--(*cnt)];
+      best=0;
+      continue;
+    }
+    break;
+  } while (1);
+
+  box=&list[(*cnt)++];
+  box->minx=x;
+  box->miny=y;
+  box->width=width;
+  box->height=height;
+}
+
+/*****************************************************************************
+  
+  Mark area of framebuffer as changed ("dirty"). All drawing functions do this 
+  already, only needed when buffer is altered directly.
+
+  In: SILFB framebuffer context, x,y,width and height of changed area
+
+ *****************************************************************************/
+
+void sil_addDirtyFB(SILFB *fb, UINT x, UINT y, UINT width, UINT height) {
+  if ((NULL==fb)||(x>=fb->width)||(y>=fb->height)) return;
+  if (width>fb->width-x) width=fb->width-x;
+  if (height>fb->height-y) height=fb->height-y;
+  sil_addBox(fb->dirty,&fb->dirtycnt,SILMAXDIRTY,x,y,width,height);
+
+  /* transparant pixels might have been overwritten, so check again later */
+  if (SILOPACITY_ALPHA==fb->opacity) fb->opacity=SILOPACITY_UNKNOWN;
+}
+
+/*****************************************************************************
+  
+  Get changed areas of framebuffer since last sil_clearDirtyFB. 
+
+  In: SILFB framebuffer context, box to store area containing all changes 
+      (can be NULL)
+  Out: number of changed areas (0 = nothing changed), individual areas can be
+       found in fb->dirty
+
+ *****************************************************************************/
+
+UINT sil_getDirtyFB(SILFB *fb, SILBOX *bounds) {
+  UINT maxx=0;
+  UINT maxy=0;
+
+  if ((NULL==fb)||(0==fb->dirtycnt)) {
+    if (bounds) {
+      bounds->minx=0;
+      bounds->miny=0;
+      bounds->width=0;
+      bounds->height=0;
+    }
+    return 0;
+  }
+  if (bounds) {
+    bounds->minx=fb->dirty[0].minx;
+    bounds->miny=fb->dirty[0].miny;
+    for (UINT i=0;i<fb->dirtycnt;i++) {
+      bounds->minx=SIL_MIN(bounds->minx,fb->dirty[i].minx);
+      bounds->miny=SIL_MIN(bounds->miny,fb->dirty[i].miny);
+      maxx=SIL_MAX(maxx,fb->dirty[i].minx+fb->dirty[i].width);
+      maxy=SIL_MAX(maxy,fb->dirty[i].miny+fb->dirty[i].height);
+    }
+    bounds->width=maxx-bounds->minx;
+    bounds->height=maxy-bounds->miny;
+  }
+  return fb->dirtycnt;
+}
+
+/*****************************************************************************
+  
+  Forget all changed areas of framebuffer, normally done after changes have
+  been handled by display or merged to display framebuffer.
+
+  In: SILFB framebuffer context
+
+ *****************************************************************************/
+
+void sil_clearDirtyFB(SILFB *fb) {
+  if (NULL==fb) return;
+
+  /* cached opacity relies on changed areas, so update it now */
+  if ((SILOPACITY_UNKNOWN!=fb->opacity)&&(fb->dirtycnt)&&
+      (hasAlpha(fb->type))) {
+    updateOpacity(fb);
+  }
+  fb->dirtycnt=0;
+}
+
+/*****************************************************************************
+  
+  Get opacity class of framebuffer: fully opaque, only fully opaque or fully
+  transparant pixels ("binary") or also partly transparant pixels. Result is
+  cached and, as long as it doesn't contain partly transparant pixels, only
+  changed areas are checked again.
+
+  In: SILFB framebuffer context
+  Out: SILOPACITY_OPAQUE, SILOPACITY_BINARY or SILOPACITY_ALPHA
+
+ *****************************************************************************/
+
+BYTE sil_getOpacityFB(SILFB *fb) {
+  if ((NULL==fb)||(0==fb->size)||(SILTYPE_EMPTY==fb->type)) return SILOPACITY_ALPHA;
+
+  /* only these types have an alpha channel */
+  if (!hasAlpha(fb->type)) return SILOPACITY_OPAQUE;
+
+  updateOpacity(fb);
+  return fb->opacity;
+}
+
+/*****************************************************************************
+  
+  Check if framebuffer has no (partly) transparant pixels at all. 
+
+  In: SILFB framebuffer context
+  Out: 1 if all pixels are fully opaque, 0 otherwise
+
+ *****************************************************************************/
+
+UINT sil_isOpaqueFB(SILFB *fb) {
+  return (SILOPACITY_OPAQUE==sil_getOpacityFB(fb));
+}
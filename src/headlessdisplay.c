@@ -0,0 +1,252 @@
+/*
+
+   headlessdisplay.c CopyRight 2021 Remco Schellekens, see LICENSE for more details.
+
+   This file contains all functions for "displaying" the layers without any real display, for
+   example on servers or for automated testing and benchmarking.
+   All layers are merged into a framebuffer in memory, that can be retrieved by the program
+   itself or dumped into a .png file. Events do not come from mouse or keyboard, but from a
+   queue filled by the program via sil_putEventDisplay.
+
+   every "...display.c" file should have these functions
+   -sil_initDisplay        ; create initial display, called via initializing SIL
+   -sil_updateDisplay      ; update display, will check all layers updates display accordingly
+   -sil_destroyDisplay     ; remove display, called via destroying SIL
+   -sil_getEventDisplay    ; Wait or get first event ( mouse / keys or closing window )
+   -sil_getTypefromDisplay ; will return the "native" color type of the display
+   -sil_setTimerDisplay    ; will set a repeating timer to interrupt the wait loop
+   -sil_stopTimerDisplay   ; stops the repeating timer
+   -sil_setCursor          ; sets the mouse cursor (in windowed environments)
+
+   and, only for this display:
+   -sil_putEventDisplay    ; add event to queue, to be returned by sil_getEventDisplay
+   -sil_getFBDisplay       ; get framebuffer holding the last updated display
+   -sil_dumpDisplay        ; save last updated display as .png file
+
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "lodepng.h"
+#include "sil.h"
+#include "log.h"
+
+/* maximum number of events waiting in queue */
+#define SILMAXEVENTS 256
+
+typedef struct _GDISP {
+  SILFB *fb;
+  SILEVENT se;
+  SILEVENT queue[SILMAXEVENTS];
+  UINT first;   /* first event in queue        */
+  UINT cnt;     /* number of events in queue   */
+  UINT timer;   /* timer interval, 0 = no timer */
+} GDISP;
+
+static GDISP gdisp;
+
+
+/*****************************************************************************
+
+  retrieve color type from Display (SILTYPE... , see framebuffer.c for info)
+  Used as "default" when no type is given when creating framebuffer
+
+ *****************************************************************************/
+
+UINT sil_getTypefromDisplay() {
+  if (NULL==gdisp.fb) {
+    log_warn("trying to get display color type from non-initialized display");
+    sil_setErr(SILERR_NOTINIT);
+    return 0;
+  }
+  return gdisp.fb->type;
+}
+
+
+/*****************************************************************************
+
+  Initialize Display (called by initSIL). There is no window, so title is
+  ignored. First option can point to a BYTE holding the SILTYPE of display
+  framebuffer, if NULL, SILTYPE_ARGB will be used.
+
+ *****************************************************************************/
+
+UINT sil_initDisplay(void *type, UINT width, UINT height, char *title) {
+  BYTE fbtype=SILTYPE_ARGB;
+
+  if (type) fbtype=*(BYTE *)type;
+  gdisp.first=0;
+  gdisp.cnt=0;
+  gdisp.timer=0;
+
+  gdisp.fb=sil_initFB(width, height, fbtype);
+  if (NULL==gdisp.fb) {
+    log_info("ERR: Can't create framebuffer for display");
+    sil_setErr(SILERR_NOMEM);
+    return SILERR_NOMEM;
+  }
+  SetDisplaySize(width,height);
+  log_info("Headless display: %dx%d, type %d",width,height,fbtype);
+  return SILERR_ALLOK;
+}
+
+/*****************************************************************************
+
+  Update Display, only merges all layers into framebuffer
+
+ *****************************************************************************/
+
+void sil_updateDisplay() {
+  if (NULL==gdisp.fb) {
+    log_warn("updating non-initialized display");
+    sil_setErr(SILERR_NOTINIT);
+    return;
+  }
+  LayersToFB(gdisp.fb);
+}
+
+/*****************************************************************************
+
+  Destroy display information (called by destroy SIL, to cleanup everything )
+
+ *****************************************************************************/
+
+void sil_destroyDisplay() {
+  if (gdisp.fb) sil_destroyFB(gdisp.fb);
+  gdisp.fb=NULL;
+  gdisp.cnt=0;
+}
+
+
+/*****************************************************************************
+
+  Get event from display
+  Returns first event from the queue. When queue is empty and a timer has
+  been set, a timer event is returned immediately, as if timer interval has
+  passed (no real waiting, so tests and benchmarks run as fast as possible).
+  When queue is empty and there is no timer, nothing can happen anymore, so
+  SILDISP_QUIT is returned.
+
+  See other displays for information about SILEVENT contents.
+
+ *****************************************************************************/
+
+SILEVENT *sil_getEventDisplay() {
+  if (gdisp.cnt) {
+    memcpy(&gdisp.se,&gdisp.queue[gdisp.first],sizeof(gdisp.se));
+    gdisp.first=(gdisp.first+1)%SILMAXEVENTS;
+    gdisp.cnt--;
+    return &gdisp.se;
+  }
+
+  memset(&gdisp.se,0,sizeof(gdisp.se));
+  if (gdisp.timer) {
+    gdisp.se.type=SILDISP_TIMER;
+    gdisp.se.code=666;
+    gdisp.se.val=gdisp.timer;
+  } else {
+    gdisp.se.type=SILDISP_QUIT;
+  }
+  return &gdisp.se;
+}
+
+/*****************************************************************************
+
+  Add event to the queue, to be returned by sil_getEventDisplay later on
+  (oldest first). Layer of event will be determined by sil_mainLoop.
+
+  In: event to add
+  Out: SILERR_ALLOK or SILERR_NOMEM if queue is full
+
+ *****************************************************************************/
+
+UINT sil_putEventDisplay(SILEVENT *se) {
+  if (NULL==se) {
+    log_warn("trying to put non-existing event in queue");
+    sil_setErr(SILERR_NOTINIT);
+    return SILERR_NOTINIT;
+  }
+  if (gdisp.cnt>=SILMAXEVENTS) {
+    log_warn("event queue of display is full");
+    sil_setErr(SILERR_NOMEM);
+    return SILERR_NOMEM;
+  }
+  memcpy(&gdisp.queue[(gdisp.first+gdisp.cnt)%SILMAXEVENTS],se,sizeof(SILEVENT));
+  gdisp.queue[(gdisp.first+gdisp.cnt)%SILMAXEVENTS].layer=NULL;
+  gdisp.cnt++;
+  sil_setErr(SILERR_ALLOK);
+  return SILERR_ALLOK;
+}
+
+/*****************************************************************************
+
+  Get framebuffer holding the display, as merged during last update
+
+ *****************************************************************************/
+
+SILFB *sil_getFBDisplay() {
+  return gdisp.fb;
+}
+
+/*****************************************************************************
+
+  Save display, as merged during last update, to given .png file
+
+ *****************************************************************************/
+
+UINT sil_dumpDisplay(char *filename) {
+  SILFB *fb;
+  UINT err;
+
+  if (NULL==gdisp.fb) {
+    log_warn("trying to dump non-initialized display");
+    sil_setErr(SILERR_NOTINIT);
+    return SILERR_NOTINIT;
+  }
+
+  /* PNG encoder needs r,g,b bytes, same as SILTYPE_888BGR */
+  fb=sil_initFB(gdisp.fb->width,gdisp.fb->height,SILTYPE_888BGR);
+  if (NULL==fb) {
+    log_warn("Can't initialize framebuffer in order to dump to png file");
+    return SILERR_NOTINIT;
+  }
+  sil_convertFB(gdisp.fb,fb,NULL,0,0,0);
+
+  /* PNG encoder needs rows without gaps in between */
+  for (UINT y=1;y<fb->height;y++) memmove(fb->buf+y*fb->width*3,fb->buf+y*fb->stride,fb->width*3);
+  err=lodepng_encode24_file(filename, fb->buf, fb->width, fb->height);
+  sil_destroyFB(fb);
+
+  if (err) {
+    switch (err) {
+      case 79:
+        /* common error, wrong filename, no rights */
+        log_warn("Can't open '%s' for writing (%d)",filename,err);
+        err=SILERR_CANTOPENFILE;
+        break;
+      default:
+        /* something wrong with encoding png */
+        log_warn("Can't encode PNG file '%s' (%d)",filename,err);
+        err=SILERR_CANTDECODEPNG;
+        break;
+    }
+    sil_setErr(err);
+    return err;
+  }
+  sil_setErr(SILERR_ALLOK);
+  return SILERR_ALLOK;
+}
+
+
+void sil_setTimerDisplay(UINT amount) {
+  gdisp.timer=amount;
+}
+
+void sil_stopTimerDisplay() {
+  gdisp.timer=0;
+}
+
+void sil_setCursor(BYTE type) {
+  /* not used */
+}
@@ -9,6 +9,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "lodepng.h"
 #include "sil.h"
 #include "log.h"
@@ -18,10 +21,138 @@ typedef struct _GLYR {
   SILLYR *top;
   SILLYR *bottom;
   UINT idcount;  /* unique identifiers for layers (not used at the moment) */
+  /* damaged areas of display (in display coordinates) since last update */
+  SILBOX damage[SILMAXDAMAGE];
+  UINT damaged;
+  SILFB *lastfb; /* framebuffer used during last LayersToFB */
+  UINT width,height; /* size of display, used by sil_screenCapture */
 } GLYR;
 
 static GLYR glyr={NULL,NULL,0}; /* holds all global variables used only within layers.c */
 
+typedef struct _GRENDER {
+  UINT threads;          /* number of threads composing, including caller  */
+  pthread_t *ids;        /* the extra threads                              */
+  pthread_mutex_t lock;
+  pthread_cond_t start;  /* signals threads that there is a new job        */
+  pthread_cond_t done;   /* signals caller that last thread finished       */
+  BYTE init;             /* lock & conditions have been initialized        */
+  BYTE quit;             /* threads should stop                            */
+  UINT job;              /* increased for every new job                    */
+  UINT busy;             /* number of threads still working on job         */
+  SILFB *fb;             /* job: framebuffer to compose into ...           */
+  UINT ox,oy;            /* ... part of display it starts at ...           */
+  SILBOX *boxes;         /* ... and areas of display to compose            */
+  UINT boxcnt;
+  SILFB *work[SILMAXTHREADS]; /* 32 bit working buffer for every thread    */
+  SILFB *capwork[SILMAXTHREADS]; /* same, for sil_composeRegion            */
+  SILFB **jobwork;       /* job: working buffers used, NULL if none        */
+  BYTE dither;           /* dither when converting working buffer          */
+  BYTE mode;             /* SILCOMPOSE_... way of merging layers           */
+  BYTE tiled;            /* job consists of tiles, see binTiles            */
+  UINT tilecols;         /* number of tiles on a row of display            */
+  UINT *tilefirst;       /* per tile, start of its list in tilelayers      */
+  SILLYR **tilelayers;   /* layers per tile, from bottom to top            */
+  SILBOX *tileboxes;     /* damaged tiles                                  */
+  UINT tilecnt;
+} GRENDER;
+
+typedef struct _GSCAN {
+  SILLYR *layer;         /* layer within area, used by scanline compositor */
+  int minx,miny,maxx,maxy; /* part of it within area, display coordinates  */
+  UINT z;                /* position from bottom                           */
+  BYTE alpha;
+} GSCAN;
+
+static GRENDER grender={1,NULL}; /* thread pool used by LayersToFB */
+
+
+/*****************************************************************************
+  Internal functions to keep track of damaged areas of the display.
+  Every change that alters what is visible on screen (moving, hiding, 
+  changing view or alpha, drawing) adds the affected area. LayersToFB will 
+  only redraw these areas instead of the whole display.
+
+  Coordinates are ints, since layers can be placed (partially) outside of 
+  display. Overlapping or touching areas are merged into one, and when there
+  is no room left, area is merged with the one that grows the least (see
+  sil_addBox).
+
+ *****************************************************************************/
+
+static void addDamage(int x, int y, int width, int height) {
+  /* display starts at 0,0, anything left or above it isn't visible */
+  if (x<0) {
+    width+=x;
+    x=0;
+  }
+  if (y<0) {
+    height+=y;
+    y=0;
+  }
+  if ((width<=0)||(height<=0)) return;
+  sil_addBox(glyr.damage,&glyr.damaged,SILMAXDAMAGE,x,y,width,height);
+}
+
+/* add visible area of given layer to damaged areas */
+static void layerDamage(SILLYR *layer) {
+  if ((NULL==layer)||(NULL==layer->fb)||(0==layer->fb->size)) return;
+  if (layer->flags&SILFLAG_INVISIBLE) return;
+  if (SILTYPE_EMPTY==layer->fb->type) return;
+  addDamage((int)layer->relx,(int)layer->rely,layer->view.width,layer->view.height);
+}
+
+/* add changed areas of framebuffer of layer, as far as within view, to     */
+/* damaged areas                                                            */
+static void dirtyDamage(SILLYR *layer) {
+  SILBOX *box;
+  UINT minx,miny,maxx,maxy;
+
+  if ((NULL==layer)||(NULL==layer->fb)||(0==layer->fb->size)) return;
+  if (layer->flags&SILFLAG_INVISIBLE) return;
+  if (SILTYPE_EMPTY==layer->fb->type) return;
+  for (UINT i=0;i<layer->fb->dirtycnt;i++) {
+    box=&layer->fb->dirty[i];
+    minx=SIL_MAX(box->minx,layer->view.minx);
+    miny=SIL_MAX(box->miny,layer->view.miny);
+    maxx=SIL_MIN(box->minx+box->width,layer->view.minx+layer->view.width);
+    maxy=SIL_MIN(box->miny+box->height,layer->view.miny+layer->view.height);
+    if ((minx>=maxx)||(miny>=maxy)) continue;
+    addDamage((int)layer->relx+(int)(minx-layer->view.minx),
+              (int)layer->rely+(int)(miny-layer->view.miny),maxx-minx,maxy-miny);
+  }
+}
+
+/*****************************************************************************
+  Mark area of display as damaged, so it will be redrawn on next update. 
+  Normally not needed, all layer functions will do this automaticly, but 
+  can be used by display functions when (part of) window has to be redrawn
+
+  In: x,y (top left of display = 0,0), width and height of area
+
+ *****************************************************************************/
+
+void sil_addDamage(UINT x, UINT y, UINT width, UINT height) {
+  if (width>INT_MAX) width=INT_MAX;
+  if (height>INT_MAX) height=INT_MAX;
+  if ((x<=INT_MAX)&&(y<=INT_MAX)) addDamage(x,y,width,height);
+  sil_setErr(SILERR_ALLOK);
+}
+
+/*****************************************************************************
+  Mark visible area of layer as damaged, so it will be redrawn on next 
+  update. Needed when framebuffer or view of layer is changed outside of
+  the layer functions.
+
+  In: Layer context
+
+ *****************************************************************************/
+
+void sil_damageLayer(SILLYR *layer) {
+  layerDamage(layer);
+  sil_setErr(SILERR_ALLOK);
+}
+
 
 /*****************************************************************************
   Create a layer and it it to linked list of layers on top
@@ -96,6 +227,7 @@ SILLYR *sil_addLayer(UINT relx, UINT rely, UINT width, UINT height, BYTE type) {
   layer->sprite.pos=0;
 
   layer->init=1;
+  layerDamage(layer);
   sil_setErr(SILERR_ALLOK);
   return layer;
 }
@@ -127,6 +259,7 @@ SILLYR *sil_mirrorLayer(SILLYR *layer, UINT relx, UINT rely) {
 
   /* copy all information */
   memcpy(newlayer,layer,sizeof(SILLYR));
+  if (newlayer->fb) newlayer->fb->refs++;
 
   /* and set new id & position*/
   newlayer->id=glyr.idcount++;
@@ -155,6 +288,7 @@ SILLYR *sil_mirrorLayer(SILLYR *layer, UINT relx, UINT rely) {
     newlayer->previous=NULL;
   }
   glyr.top=newlayer;
+  layerDamage(newlayer);
 
   sil_setErr(SILERR_ALLOK);
   return newlayer;
@@ -321,8 +455,10 @@ void sil_moveLayer(SILLYR *layer,int x,int y) {
     return;
   }
 #endif
+  layerDamage(layer);
   layer->relx+=x;
   layer->rely+=y;
+  layerDamage(layer);
   sil_setErr(SILERR_ALLOK);
 }
 
@@ -341,8 +477,10 @@ void sil_placeLayer(SILLYR *layer, UINT x,UINT y) {
     return;
   }
 #endif
+  layerDamage(layer);
   layer->relx=x;
   layer->rely=y;
+  layerDamage(layer);
   sil_setErr(SILERR_ALLOK);
 }
 /*****************************************************************************
@@ -406,43 +544,61 @@ void sil_putPixelLayer(SILLYR *layer, UINT x, UINT y, BYTE red, BYTE green, BYTE
 }
 
 /*****************************************************************************
-  Draw a pixel on given location inside a layer, but uses alpha value to 
-  blend pixel with pixel already on that position
+  Draw a row ("span") of pixels on given location inside a layer, but uses 
+  alpha value of every pixel to blend it with pixel already on that position
 
-  In: layer context, x,y position
-      RGBA color values
+  In: layer context, x,y position, number of pixels
+      array with 4 bytes per pixel; red,green,blue,alpha
 
  *****************************************************************************/
 
-void sil_blendPixelLayer(SILLYR *layer, UINT x, UINT y, BYTE red, BYTE green, BYTE blue, BYTE alpha) {
-  BYTE mixred,mixgreen,mixblue,mixalpha;
-  float af,negaf;
+void sil_blendSpanLayer(SILLYR *layer, UINT x, UINT y, UINT n, BYTE *rgba) {
+  BYTE mix[SILSPANCHUNK*4];
+  UINT cnt;
 
 #ifndef SIL_LIVEDANGEROUS
-  if ((NULL==layer)||(NULL==layer->fb)||(0==layer->fb->size)) {
-    log_warn("blendPixelLayer on layer that isn't initialized, or with uninitialized FB");
+  if ((NULL==layer)||(NULL==layer->fb)||(0==layer->fb->size)||(NULL==rgba)) {
+    log_warn("blendSpanLayer on layer that isn't initialized, or with uninitialized FB");
     sil_setErr(SILERR_NOTINIT);
     return;
   }
 #endif
-  sil_getPixelLayer(layer,x,y,&mixred,&mixgreen,&mixblue,&mixalpha);
-  if (mixalpha>0) {
-    /* only mix when underlaying pixel doesn't have 0 alpha */
-    if (0==alpha) return; /* nothing to do */
-    if (alpha<255) {
-      /* only calculate when its less then 100% opaque */
-      af=((float)alpha)/255;
-      negaf=1-af;
-      red=red*af+negaf*mixred;
-      green=green*af+negaf*mixgreen;
-      blue=blue*af+negaf*mixblue;
-      if (mixalpha>alpha) alpha=mixalpha;
-    }
+  /* don't draw if outside of dimensions of framebuffer */
+  if ((x >= layer->fb->width)||(y >= layer->fb->height)) return;
+  if (n > layer->fb->width-x) n=layer->fb->width-x;
+
+  /* done in chunks, to keep the buffer for the pixels underneath on stack */
+  while (n) {
+    cnt=SIL_MIN(n,SILSPANCHUNK);
+    sil_getSpanFB(layer->fb,x,y,cnt,mix);
+    sil_mixSpan(mix,rgba,cnt);
+    sil_putSpanFB(layer->fb,x,y,cnt,mix);
+    rgba+=cnt*4;
+    x+=cnt;
+    n-=cnt;
   }
-  sil_putPixelLayer(layer,x,y,red,green,blue,alpha);
   sil_setErr(SILERR_ALLOK);
 }
 
+/*****************************************************************************
+  Draw a pixel on given location inside a layer, but uses alpha value to 
+  blend pixel with pixel already on that position
+
+  In: layer context, x,y position
+      RGBA color values
+
+ *****************************************************************************/
+
+void sil_blendPixelLayer(SILLYR *layer, UINT x, UINT y, BYTE red, BYTE green, BYTE blue, BYTE alpha) {
+  BYTE rgba[4];
+
+  rgba[0]=red;
+  rgba[1]=green;
+  rgba[2]=blue;
+  rgba[3]=alpha;
+  sil_blendSpanLayer(layer,x,y,1,rgba);
+}
+
 /*****************************************************************************
   Draw a pixel on given location inside a layer, but uses alpha value to 
   blend pixel with pixel already on that position
@@ -482,6 +638,8 @@ void sil_setFlags(SILLYR *layer,BYTE flags) {
     return;
   }
 #endif
+  /* becoming invisible, so redraw area where it was */
+  if (flags&SILFLAG_INVISIBLE) layerDamage(layer);
   layer->flags|=flags;
   sil_setErr(SILERR_ALLOK);
 }
@@ -495,6 +653,8 @@ void sil_clearFlags(SILLYR *layer,BYTE flags) {
   }
 #endif
   layer->flags&=~flags;
+  /* might be visible again, so redraw area where it is */
+  if (flags&SILFLAG_INVISIBLE) layerDamage(layer);
   sil_setErr(SILERR_ALLOK);
 }
 
@@ -530,39 +690,19 @@ SILLYR *sil_getTop() {
   return glyr.top;
 }
 
-/*****************************************************************************
-  Internal function to check if layer is instanciated and twin(s) of it are
-  still around...
-  return amount of instances found
-
- *****************************************************************************/
-
-static int hasInstance(SILLYR *layer) {
-  UINT cnt=0;
-  SILLYR *search;
-
-  if (0==layer->internal&SILFLAG_INSTANCIATED) return 0;
-  search=glyr.bottom;
-  while(search) {
-    if ((search != layer)&&(search->internal&SILFLAG_INSTANCIATED)) {
-      if (search->fb==layer->fb) cnt++; 
-    }
-    search=search->next;
-  }
-  sil_setErr(SILERR_ALLOK);
-  return cnt;
-}
-
 /*****************************************************************************
   Remove layer
  *****************************************************************************/
 void sil_destroyLayer(SILLYR *layer) {
   if ((layer)&&(layer->init)) {
-    if (0==hasInstance(layer)) sil_destroyFB(layer->fb);
-    layer->init=0;
+    layerDamage(layer);
     sil_toBottom(layer);
+    /* only really destroyed when no other instances/mirrors use it */
+    sil_destroyFB(layer->fb);
+    layer->init=0;
     glyr.bottom=layer->next;
-    layer->next->previous=NULL;
+    if (layer->next) layer->next->previous=NULL;
+    if (glyr.top==layer) glyr.top=NULL;
     if ((layer->flags&SILFLAG_FREEUSER)&&(layer->user)) free(layer->user);
     free(layer);
   } else {
@@ -585,6 +725,7 @@ void sil_setAlphaLayer(SILLYR *layer, float alpha) {
 #endif
   if (alpha>1) alpha=1;
   if (alpha<=0) alpha=0;
+  if (alpha!=layer->alpha) layerDamage(layer);
   layer->alpha=alpha;
   layer->internal|=SILFLAG_ALPHACHANGED;
   sil_setErr(SILERR_ALLOK);
@@ -608,6 +749,7 @@ void sil_setView(SILLYR *layer,UINT minx,UINT miny,UINT width,UINT height) {
   if (miny>=layer->fb->height) miny=layer->fb->height-1;
   if (width>layer->fb->width) width=layer->fb->width;
   if (height>layer->fb->height) height=layer->fb->height;
+  layerDamage(layer);
   layer->view.minx=minx;
   layer->view.miny=miny;
   layer->view.width=width;
@@ -616,6 +758,7 @@ void sil_setView(SILLYR *layer,UINT minx,UINT miny,UINT width,UINT height) {
     layer->relx+=minx;
     layer->rely+=miny;
   }
+  layerDamage(layer);
   sil_setErr(SILERR_ALLOK);
 }
 
@@ -631,6 +774,7 @@ void sil_resetView(SILLYR *layer) {
     return;
   }
 #endif
+  layerDamage(layer);
   if (sil_checkFlags(layer,SILFLAG_VIEWPOSSTAY)) {
     layer->relx-=layer->view.minx;
     layer->rely-=layer->view.miny;
@@ -639,19 +783,21 @@ void sil_resetView(SILLYR *layer) {
   layer->view.miny=0;
   layer->view.width=layer->fb->width;
   layer->view.height=layer->fb->height;
+  layerDamage(layer);
   sil_setErr(SILERR_ALLOK);
 }
 
 /*****************************************************************************
-  Resize layer (used for cropping and turning) will create a temporary 
-  framebuffer
+  Resize layer (used for cropping and turning). When new area lies within 
+  current framebuffer, it will just become a view on it (no copying), 
+  otherwise a temporary framebuffer is created
 
   In: Layer context x,y top left within layer + width & height of view
 
  *****************************************************************************/
 UINT sil_resizeLayer(SILLYR *layer, UINT minx,UINT miny,UINT width,UINT height) {
   SILFB *tmpfb;
-  BYTE red,green,blue,alpha;
+  SILBOX box;
   UINT err=0;
 
 #ifndef SIL_LIVEDANGEROUS
@@ -666,34 +812,38 @@ UINT sil_resizeLayer(SILLYR *layer, UINT minx,UINT miny,UINT width,UINT height)
   /* no use to create 'empty' sizes... */
   if ((0==width)||(0==height)) return SILERR_WRONGFORMAT;
 
-  /* create temporary framebuffer to copy from old one into */
-  tmpfb=sil_initFB(width,height,layer->fb->type);
-  if (NULL==tmpfb) {
-    log_info("ERR: Can't create temporary framebuffer for resizing");
-    return sil_getErr();
+  /* cropping only, no need to copy */
+  tmpfb=NULL;
+  if ((minx+width<=layer->fb->width)&&(miny+height<=layer->fb->height)&&
+      (!(minx%2)||((SILTYPE_444RGB!=layer->fb->type)&&(SILTYPE_444BGR!=layer->fb->type)))&&
+      (!(minx%8)||(SILTYPE_A1!=layer->fb->type))) {
+    tmpfb=sil_subFB(layer->fb,minx,miny,width,height);
   }
 
-
-  /* copy selected part */
-  for (int x=minx;x<minx+width;x++) {
-    for (int y=miny;y<miny+height;y++) {
-        sil_getPixelFB(layer->fb,x,y,&red,&green,&blue,&alpha);
-        sil_putPixelFB(tmpfb,x-minx,y-miny,red,green,blue,alpha);
+  if (NULL==tmpfb) {
+    /* create temporary framebuffer to copy from old one into */
+    tmpfb=sil_initFB(width,height,layer->fb->type);
+    if (NULL==tmpfb) {
+      log_info("ERR: Can't create temporary framebuffer for resizing");
+      return sil_getErr();
     }
+
+    /* copy selected part, parts outside old framebuffer stay empty */
+    box.minx=minx;
+    box.miny=miny;
+    box.width=width;
+    box.height=height;
+    sil_convertFB(layer->fb,tmpfb,&box,0,0,0);
   }
-  /* throw away old framebuffer */
-  free(layer->fb->buf);
 
-  /* and copy info from temp framebuffer in it */
-  layer->fb->buf=tmpfb->buf;
-  layer->fb->width=tmpfb->width;
-  layer->fb->height=tmpfb->height;
-  layer->fb->type=tmpfb->type;
-  layer->fb->size=tmpfb->size;
+  /* replace old framebuffer */
+  layerDamage(layer);
+  ReplaceFB(layer->fb,tmpfb);
   layer->view.minx=0;
   layer->view.miny=0;
-  layer->view.width=tmpfb->width;
-  layer->view.height=tmpfb->height;
+  layer->view.width=layer->fb->width;
+  layer->view.height=layer->fb->height;
+  layerDamage(layer);
   sil_setErr(SILERR_ALLOK);
   return 0;
 }
@@ -712,18 +862,118 @@ UINT sil_resizeLayer(SILLYR *layer, UINT minx,UINT miny,UINT width,UINT height)
  *****************************************************************************/
 
 SILLYR *sil_PNGtoNewLayer(char *filename,UINT x,UINT y) {
+  return sil_PNGtoNewLayerType(filename,x,y,SILTYPE_ABGR);
+}
+
+/*****************************************************************************
+
+  Internal functions: create SILTYPE_PAL8 framebuffer from decoded PNG. 
+  Either from the palette indices of a palette PNG (1,2,4 or 8 bits per 
+  pixel, without gaps between rows) or from rgba pixels, as long as there 
+  aren't more than 256 different colors. Both take ownership of image.
+
+ *****************************************************************************/
+
+static SILFB *indexedToFB(BYTE *image, UINT width, UINT height, LodePNGColorMode *mode) {
+  SILFB *fb;
+  BYTE *idx;
+  UINT bits=mode->bitdepth;
+
+  if (bits<8) {
+    idx=malloc(width*height);
+    if (NULL==idx) {
+      free(image);
+      return NULL;
+    }
+    for (UINT i=0;i<width*height;i++) {
+      idx[i]=(image[i*bits/8]>>(8-bits-(i*bits)%8))&((1<<bits)-1);
+    }
+    free(image);
+    image=idx;
+  }
+  fb=AdoptFB(image,width,height,0,SILTYPE_PAL8);
+  if (NULL==fb) {
+    free(image);
+    return NULL;
+  }
+  memset(fb->pal,0,256*4);
+  memcpy(fb->pal,mode->palette,SIL_MIN(mode->palettesize,256)*4);
+  return fb;
+}
+
+static SILFB *rgbaToPalFB(BYTE *image, UINT width, UINT height) {
+  SILFB *fb;
+  BYTE *p=image;
+  UINT cnt=0;
+  UINT idx=0;
+
+  fb=sil_initFB(width,height,SILTYPE_PAL8);
+  if (NULL==fb) {
+    free(image);
+    return NULL;
+  }
+  memset(fb->pal,0,256*4);
+  for (UINT i=0;i<width*height;i++,p+=4) {
+    /* neighbouring pixels mostly have same color */
+    if ((cnt)&&(0==memcmp(fb->pal+idx*4,p,4))) {
+      fb->buf[(i/width)*fb->stride+i%width]=idx;
+      continue;
+    }
+    for (idx=0;(idx<cnt)&&(memcmp(fb->pal+idx*4,p,4));idx++);
+    if (idx==cnt) {
+      if (256==cnt) {
+        log_warn("PNG has more then 256 colors, can't use palette");
+        sil_setErr(SILERR_WRONGFORMAT);
+        sil_destroyFB(fb);
+        free(image);
+        return NULL;
+      }
+      memcpy(fb->pal+cnt*4,p,4);
+      cnt++;
+    }
+    fb->buf[(i/width)*fb->stride+i%width]=idx;
+  }
+  free(image);
+  return fb;
+}
+
+/*****************************************************************************
+
+  Same as sil_PNGtoNewLayer, but layer will get given type. For SILTYPE_ABGR
+  and SILTYPE_PARGB (premultiplied, faster blending) the decoded image 
+  itself is used as framebuffer, other types are converted. 
+  SILTYPE_PAL8 uses palette of PNG, or its colors, if not more than 256. 
+  Type 0 means SILTYPE_PAL8 for palette PNGs, SILTYPE_ABGR for others.
+
+ *****************************************************************************/
+
+SILLYR *sil_PNGtoNewLayerType(char *filename,UINT x,UINT y,BYTE type) {
   SILLYR *layer=NULL;
+  SILFB *fb;
+  SILFB *tmpfb;
   BYTE *image =NULL;
+  BYTE *png=NULL;
+  size_t pngsize=0;
+  LodePNGState state;
+  BYTE *p;
+  BYTE tmp;
   UINT err=0;
-  UINT pos=0;
   UINT width=0;
   UINT height=0;
-  UINT maxwidth=0;
-  UINT maxheight=0;
-  BYTE red,green,blue,alpha;
 
-  /* load image in framebuffer */
-  err=lodepng_decode32_file(&image,&width,&height,filename);
+  /* load image, as palette indices when possible and wanted, else rgba */
+  lodepng_state_init(&state);
+  err=lodepng_load_file(&png,&pngsize,filename);
+  if (!err) err=lodepng_inspect(&width,&height,&state,png,pngsize);
+  if (!err) {
+    if ((LCT_PALETTE==state.info_png.color.colortype)&&((0==type)||(SILTYPE_PAL8==type))) {
+      type=SILTYPE_PAL8;
+      state.decoder.color_convert=0;
+    }
+    err=lodepng_decode(&image,&width,&height,&state,png,pngsize);
+  }
+  free(png);
+  if (0==type) type=SILTYPE_ABGR;
   if ((!err)&&((0==width)||(0==height))) {
     /* doesn't make sense loading a PNG file with no height and/or width */
     log_warn("'%s' appears to have unusual width x height (%d x %d)",filename,width,height);
@@ -751,33 +1001,963 @@ SILLYR *sil_PNGtoNewLayer(char *filename,UINT x,UINT y) {
     }
     sil_setErr(err);
     if (image) free(image);
+    lodepng_state_cleanup(&state);
     return NULL;
   }
-  /* first create layer */
-  layer=sil_addLayer(x,y,width,height,SILTYPE_ABGR);
+  /* first create layer, its 1x1 framebuffer will be replaced */
+  layer=sil_addLayer(x,y,1,1,type);
   if (NULL==layer) {
     log_warn("Can't create layer for loaded PNG file");
     sil_setErr(SILERR_WRONGFORMAT);
     if (image) free(image);
+    lodepng_state_cleanup(&state);
     return NULL;
   }
 
-  /* free the framebuffer memory */
-  if (!(( layer->fb) && (layer->fb->buf))) {
-    log_warn("Created layer for PNG has incorrect or missing framebuffer");
-    sil_setErr(SILERR_NOTINIT);
-    if (image) free(image);
+  switch (type) {
+    case SILTYPE_PAL8:
+      if (state.decoder.color_convert) {
+        fb=rgbaToPalFB(image,width,height);
+      } else {
+        fb=indexedToFB(image,width,height,&state.info_png.color);
+      }
+      break;
+    case SILTYPE_PARGB:
+      /* premultiply colors and swap red and blue, in place */
+      p=image;
+      for (UINT i=0;i<width*height;i++,p+=4) {
+        tmp=p[0];
+        p[0]=(p[2]*p[3]+127)/255;
+        p[1]=(p[1]*p[3]+127)/255;
+        p[2]=(tmp*p[3]+127)/255;
+      }
+      /* fall through */
+    case SILTYPE_ABGR:
+      /* use the loaded image as framebuffer, its rows don't have gaps */
+      fb=AdoptFB(image,width,height,0,type);
+      if (NULL==fb) free(image);
+      break;
+    default:
+      fb=sil_initFB(width,height,type);
+      tmpfb=sil_wrapFB(image,width,height,0,SILTYPE_ABGR);
+      if (tmpfb) {
+        if (fb) sil_convertFB(tmpfb,fb,NULL,0,0,0);
+        sil_destroyFB(tmpfb);
+      } else if (fb) {
+        /* nothing to convert from, don't return an empty layer */
+        err=sil_getErr();
+        sil_destroyFB(fb);
+        sil_setErr(err);
+        fb=NULL;
+      }
+      free(image);
+      break;
+  }
+  lodepng_state_cleanup(&state);
+  if (NULL==fb) {
+    log_warn("Can't use loaded PNG image as framebuffer");
+    /* sil_destroyLayer resets error, keep the one that made this fail */
+    err=sil_getErr();
+    if (SILERR_ALLOK==err) err=SILERR_NOMEM;
+    sil_destroyLayer(layer);
+    sil_setErr(err);
     return NULL;
   }
-  free(layer->fb->buf);
-
-  /* and swap the buf with the loaded image */
-  layer->fb->buf=image;
+  ReplaceFB(layer->fb,fb);
+  layer->view.width=width;
+  layer->view.height=height;
+  layerDamage(layer);
 
   sil_setErr(SILERR_ALLOK);
   return layer;
 }
 
+/*****************************************************************************
+
+  Internal function: get part of visible layer (in display coordinates) that 
+  falls within given area. Returns 0 if nothing of layer is within area.
+
+ *****************************************************************************/
+
+static UINT layerArea(SILLYR *layer, int bminx, int bminy, int bmaxx, int bmaxy,
+    int *minx, int *miny, int *maxx, int *maxy) {
+  if (layer->flags&SILFLAG_INVISIBLE) return 0;
+  *minx=SIL_MAX((int)layer->relx,bminx);
+  *miny=SIL_MAX((int)layer->rely,bminy);
+  *maxx=SIL_MIN((int)layer->relx+(int)layer->view.width,bmaxx);
+  *maxy=SIL_MIN((int)layer->rely+(int)layer->view.height,bmaxy);
+  return ((*minx<*maxx)&&(*miny<*maxy));
+}
+
+/*****************************************************************************
+
+  Internal function: number of bytes per pixel, 0 if pixels don't start at 
+  a byte boundary
+
+ *****************************************************************************/
+
+static UINT pixelBytes(BYTE type) {
+  switch (type) {
+    case SILTYPE_332RGB:
+    case SILTYPE_332BGR:
+      return 1;
+    case SILTYPE_555RGB:
+    case SILTYPE_555BGR:
+    case SILTYPE_565RGB:
+    case SILTYPE_565BGR:
+      return 2;
+    case SILTYPE_666RGB:
+    case SILTYPE_666BGR:
+    case SILTYPE_888RGB:
+    case SILTYPE_888BGR:
+      return 3;
+    case SILTYPE_ABGR:
+    case SILTYPE_ARGB:
+    case SILTYPE_PARGB:
+      return 4;
+  }
+  return 0;
+}
+
+/*****************************************************************************
+
+  Internal function: merge n pixels of layer into framebuffer, starting at 
+  x,y (display coordinates), framebuffer starts at ox,oy of display. Uses
+  cheapest way possible, depending on 
+  opacity of layer:
+  - fully opaque: just copy pixels (memcpy if same type)
+  - only fully opaque or fully transparant pixels: copy opaque pixels only
+  - otherwise: blend pixels with framebuffer, premultiplied layers directly
+    in memory of ARGB framebuffer (same byte order)
+
+ *****************************************************************************/
+
+static void mergeRow(SILFB *fb, SILLYR *layer, int x, int y, UINT n, BYTE alpha, UINT ox, UINT oy) {
+  BYTE src[SILSPANCHUNK*4];
+  BYTE dst[SILSPANCHUNK*4];
+  UINT bytes;
+  UINT cnt,run;
+  int rx,ry;
+
+  rx=x-(int)layer->relx+layer->view.minx;
+  ry=y-(int)layer->rely+layer->view.miny;
+  x-=(int)ox;
+  y-=(int)oy;
+
+  if (layer->internal&SILFLAG_OPAQUE) {
+    bytes=pixelBytes(fb->type);
+
+    /* opaque premultiplied pixels are the same as normal ones */
+    if (((layer->fb->type==fb->type)||
+         ((SILTYPE_PARGB==layer->fb->type)&&(SILTYPE_ARGB==fb->type)))&&(bytes)) {
+      memcpy(fb->buf+y*fb->stride+x*bytes,layer->fb->buf+ry*layer->fb->stride+rx*bytes,n*bytes);
+      return;
+    }
+    for (;n;n-=cnt,x+=cnt,rx+=cnt) {
+      cnt=SIL_MIN(n,SILSPANCHUNK);
+      FBToSpan(layer->fb,rx,ry,cnt,src);
+      SpanToFB(fb,x,y,cnt,src);
+    }
+    return;
+  }
+
+  if (layer->internal&SILFLAG_BINARYALPHA) {
+    for (;n;n-=cnt,x+=cnt,rx+=cnt) {
+      cnt=SIL_MIN(n,SILSPANCHUNK);
+      FBToSpan(layer->fb,rx,ry,cnt,src);
+      for (UINT i=0;i<cnt;i+=run) {
+        /* find run of pixels that are either all visible or all invisible */
+        for (run=1;(i+run<cnt)&&(src[(i+run)*4+3]==src[i*4+3]);run++);
+        if (src[i*4+3]) SpanToFB(fb,x+i,y,run,src+i*4);
+      }
+    }
+    return;
+  }
+
+  if (SILTYPE_PARGB==layer->fb->type) {
+    if (SILTYPE_ARGB==fb->type) {
+      sil_blendPreSpan(fb->buf+y*fb->stride+x*4,layer->fb->buf+ry*layer->fb->stride+rx*4,n,alpha);
+      return;
+    }
+    for (;n;n-=cnt,x+=cnt,rx+=cnt) {
+      cnt=SIL_MIN(n,SILSPANCHUNK);
+      FBToPreSpan(layer->fb,rx,ry,cnt,src);
+      FBToSpan(fb,x,y,cnt,dst);
+      sil_blendPreSpan(dst,src,cnt,alpha);
+      SpanToFB(fb,x,y,cnt,dst);
+    }
+    return;
+  }
+
+  for (;n;n-=cnt,x+=cnt,rx+=cnt) {
+    cnt=SIL_MIN(n,SILSPANCHUNK);
+    FBToSpan(layer->fb,rx,ry,cnt,src);
+    FBToSpan(fb,x,y,cnt,dst);
+    sil_blendSpan(dst,src,cnt,alpha);
+    SpanToFB(fb,x,y,cnt,dst);
+  }
+}
+
+/*****************************************************************************
+
+  Internal function: redraw given area of display framebuffer by merging all
+  visible layers, from bottom till top, within that area. Result is written
+  in framebuffer "out", that starts at ox,oy of display (either display
+  framebuffer itself, 32 bit working buffer or framebuffer of region, see
+  sil_composeRegion). Area has to be within "out".
+
+  Opaque layers hide everything underneath. So first, going from top to 
+  bottom, the covered parts are collected. Merging starts at the highest
+  opaque layer covering the whole area (no need to clear area then) and 
+  skips all parts of layers that are covered by opaque layers above them.
+
+ *****************************************************************************/
+
+static void composeArea(SILBOX *box, SILFB *out, UINT ox, UINT oy) {
+  SILLYR *layer;
+  SILLYR *start=NULL;
+  SILBOX cover[SILMAXCOVER]; /* opaque parts, in display coordinates       */
+  UINT coverdepth[SILMAXCOVER];
+  UINT covers=0;
+  UINT above[SILMAXCOVER];   /* covers above layer, overlapping it         */
+  UINT aboves;
+  UINT depth=0;              /* 0 = top layer, 1 = one below it, etc.      */
+  BYTE dst[SILSPANCHUNK*4];
+  BYTE alpha;
+  BYTE moved;
+  UINT cnt;
+  int minx,miny,maxx,maxy;
+  int bminx,bminy,bmaxx,bmaxy;
+  int x,end;
+  SILBOX *c;
+
+  bminx=box->minx;
+  bminy=box->miny;
+  bmaxx=box->minx+box->width;
+  bmaxy=box->miny+box->height;
+  if ((bminx>=bmaxx)||(bminy>=bmaxy)) return;
+
+  /* find opaque parts, from top to bottom */
+  layer=glyr.top;
+  while (layer) {
+    if ((layer->internal&SILFLAG_OPAQUE)&&
+        (layerArea(layer,bminx,bminy,bmaxx,bmaxy,&minx,&miny,&maxx,&maxy))) {
+      if ((minx==bminx)&&(miny==bminy)&&(maxx==bmaxx)&&(maxy==bmaxy)) {
+        start=layer;
+        break;
+      }
+      if (covers<SILMAXCOVER) {
+        cover[covers].minx=minx;
+        cover[covers].miny=miny;
+        cover[covers].width=maxx-minx;
+        cover[covers].height=maxy-miny;
+        coverdepth[covers]=depth;
+        covers++;
+      }
+    }
+    layer=layer->previous;
+    depth++;
+  }
+
+  if (NULL==start) {
+    /* nothing covers whole area, clear it first. 32 bit pixels can be     */
+    /* cleared directly, complete rows without gaps in between at once.    */
+    /* Only touch pixels of area itself: framebuffer can be a view on      */
+    /* another one, or have padding at end of rows                         */
+    if (SILTYPE_ARGB==out->type) {
+      if (((int)ox==bminx)&&((int)(ox+out->width)==bmaxx)&&(out->stride==out->width*4)) {
+        memset(out->buf+(bminy-oy)*out->stride,0,(bmaxy-bminy)*out->stride);
+      } else {
+        for (int y=bminy;y<bmaxy;y++) {
+          memset(out->buf+(y-oy)*out->stride+(bminx-ox)*4,0,(bmaxx-bminx)*4);
+        }
+      }
+    } else {
+      memset(dst,0,sizeof(dst));
+      for (int y=bminy;y<bmaxy;y++) {
+        for (x=bminx;x<bmaxx;x+=cnt) {
+          cnt=SIL_MIN(bmaxx-x,SILSPANCHUNK);
+          SpanToFB(out,x-ox,y-oy,cnt,dst);
+        }
+      }
+    }
+    start=glyr.bottom; /* not sil_getBottom, it sets error for all threads */
+    depth--;
+  }
+
+  layer=start;
+  while (layer) {
+    if (layerArea(layer,bminx,bminy,bmaxx,bmaxy,&minx,&miny,&maxx,&maxy)) {
+
+      /* which opaque parts above this layer overlap it ? */
+      aboves=0;
+      for (UINT i=0;i<covers;i++) {
+        c=&cover[i];
+        if (coverdepth[i]>=depth) continue;
+        if (((int)c->minx>=maxx)||((int)(c->minx+c->width)<=minx)) continue;
+        if (((int)c->miny>=maxy)||((int)(c->miny+c->height)<=miny)) continue;
+        if (((int)c->minx<=minx)&&((int)(c->minx+c->width)>=maxx)&&
+            ((int)c->miny<=miny)&&((int)(c->miny+c->height)>=maxy)) {
+          /* completely hidden */
+          aboves=UINT_MAX;
+          break;
+        }
+        above[aboves++]=i;
+      }
+      alpha=layer->alpha*255+0.5;
+
+      for (int absy=miny; (aboves!=UINT_MAX)&&(absy<maxy); absy++) {
+        x=minx;
+        while (x<maxx) {
+          /* skip covered pixels */
+          do {
+            moved=0;
+            for (UINT i=0;i<aboves;i++) {
+              c=&cover[above[i]];
+              if ((absy<(int)c->miny)||(absy>=(int)(c->miny+c->height))) continue;
+              if ((x>=(int)c->minx)&&(x<(int)(c->minx+c->width))) {
+                x=c->minx+c->width;
+                moved=1;
+              }
+            }
+          } while (moved);
+          if (x>=maxx) break;
+
+          /* merge till next covered part */
+          end=maxx;
+          for (UINT i=0;i<aboves;i++) {
+            c=&cover[above[i]];
+            if ((absy<(int)c->miny)||(absy>=(int)(c->miny+c->height))) continue;
+            if (((int)c->minx>x)&&((int)c->minx<end)) end=c->minx;
+          }
+          mergeRow(out,layer,x,absy,end-x,alpha,ox,oy);
+          x=end;
+        }
+      }
+    }
+    layer=layer->next;
+    depth--;
+  }
+}
+
+/*****************************************************************************
+
+  Internal functions: scanline compositor, alternative for composeArea for
+  many small, overlapping layers. Instead of merging layer by layer (going
+  over same rows of framebuffer again for every layer), every row is done
+  once: all layers on that row are merged, from bottom to top, into a span
+  on stack, that is written into the framebuffer at the end. 
+
+  Layers within area are sorted on their first row, to keep a list of 
+  active layers for every row (in order of bottom to top) without checking
+  all layers again. Rows are done in parts of SILSPANCHUNK pixels. Merging 
+  of a part starts at highest opaque layer covering it completely. 
+
+ *****************************************************************************/
+
+static void mergeSpan(BYTE *dst, GSCAN *scan, int x, int y, UINT n) {
+  SILLYR *layer=scan->layer;
+  BYTE src[SILSPANCHUNK*4];
+  int rx,ry;
+
+  rx=x-(int)layer->relx+layer->view.minx;
+  ry=y-(int)layer->rely+layer->view.miny;
+
+  if (layer->internal&SILFLAG_OPAQUE) {
+    FBToSpan(layer->fb,rx,ry,n,dst);
+    return;
+  }
+  if (layer->internal&SILFLAG_BINARYALPHA) {
+    FBToSpan(layer->fb,rx,ry,n,src);
+    for (UINT i=0;i<n;i++) {
+      if (src[i*4+3]) memcpy(dst+i*4,src+i*4,4);
+    }
+    return;
+  }
+  if (SILTYPE_PARGB==layer->fb->type) {
+    FBToPreSpan(layer->fb,rx,ry,n,src);
+    sil_blendPreSpan(dst,src,n,scan->alpha);
+    return;
+  }
+  FBToSpan(layer->fb,rx,ry,n,src);
+  sil_blendSpan(dst,src,n,scan->alpha);
+}
+
+static int scanOrder(const void *a, const void *b) {
+  const GSCAN *sa=a;
+  const GSCAN *sb=b;
+
+  /* first row, bottom to top for same row */
+  if (sa->miny!=sb->miny) return (sa->miny<sb->miny)?-1:1;
+  return (sa->z<sb->z)?-1:(sa->z>sb->z);
+}
+
+static UINT scanCovers(GSCAN *sc, int x, UINT n) {
+  return ((sc->layer->internal&SILFLAG_OPAQUE)&&(sc->minx<=x)&&(sc->maxx>=x+(int)n));
+}
+
+static void scanArea(SILBOX *box, SILFB *out, UINT ox, UINT oy, SILLYR **list, UINT listcnt) {
+  BYTE row[SILSPANCHUNK*4];
+  SILLYR *layer;
+  GSCAN *scans;
+  GSCAN **active;
+  GSCAN *sc;
+  UINT cnt=0;
+  UINT z;
+  UINT actives=0;
+  UINT next=0;
+  UINT start,n,j;
+  int minx,miny,maxx,maxy;
+  int bminx,bminy,bmaxx,bmaxy;
+  int from,till;
+
+  bminx=box->minx;
+  bminy=box->miny;
+  bmaxx=box->minx+box->width;
+  bmaxy=box->miny+box->height;
+  if ((bminx>=bmaxx)||(bminy>=bmaxy)) return;
+
+  /* collect layers within area, from bottom to top. Either given list or */
+  /* all layers                                                            */
+  if (NULL==list) {
+    for (layer=glyr.bottom;layer;layer=layer->next) listcnt++;
+  }
+  scans=malloc((listcnt+1)*(sizeof(GSCAN)+sizeof(GSCAN *)));
+  if (NULL==scans) {
+    /* do it the normal way then */
+    composeArea(box,out,ox,oy);
+    return;
+  }
+  active=(GSCAN **)(scans+listcnt+1);
+  layer=glyr.bottom;
+  for (z=0;z<listcnt;z++,layer=layer->next) {
+    if (list) layer=list[z];
+    if (!layerArea(layer,bminx,bminy,bmaxx,bmaxy,&minx,&miny,&maxx,&maxy)) continue;
+    sc=&scans[cnt++];
+    sc->layer=layer;
+    sc->z=z;
+    sc->minx=minx;
+    sc->miny=miny;
+    sc->maxx=maxx;
+    sc->maxy=maxy;
+    sc->alpha=layer->alpha*255+0.5;
+  }
+  qsort(scans,cnt,sizeof(GSCAN),scanOrder);
+
+  for (int y=bminy;y<bmaxy;y++) {
+    /* drop layers that ended, add layers that start on this row, keeping */
+    /* active list sorted from bottom to top                               */
+    j=0;
+    for (UINT i=0;i<actives;i++) {
+      if (active[i]->maxy>y) active[j++]=active[i];
+    }
+    actives=j;
+    while ((next<cnt)&&(scans[next].miny==y)) {
+      sc=&scans[next++];
+      for (j=actives;(j>0)&&(active[j-1]->z>sc->z);j--) active[j]=active[j-1];
+      active[j]=sc;
+      actives++;
+    }
+
+    for (int x=bminx;x<bmaxx;x+=n) {
+      n=SIL_MIN(bmaxx-x,SILSPANCHUNK);
+
+      /* start at highest opaque layer covering this part */
+      for (start=actives;(start>0)&&(!scanCovers(active[start-1],x,n));start--);
+      if (start) {
+        start--;
+      } else {
+        /* nothing covers this part, clear it first */
+        memset(row,0,n*4);
+      }
+
+      for (UINT i=start;i<actives;i++) {
+        sc=active[i];
+        from=SIL_MAX(sc->minx,x);
+        till=SIL_MIN(sc->maxx,x+(int)n);
+        if (from>=till) continue;
+        mergeSpan(row+(from-x)*4,sc,from,y,till-from);
+      }
+      SpanToFB(out,x-ox,y-oy,n,row);
+    }
+  }
+  free(scans);
+}
+
+static void composeScanlines(SILBOX *box, SILFB *out, UINT ox, UINT oy) {
+  scanArea(box,out,ox,oy,NULL,0);
+}
+
+/*****************************************************************************
+
+  Internal functions: tile compositor. Display is divided in tiles of 
+  SILTILESIZE x SILTILESIZE pixels. Every update, damaged tiles are marked 
+  and all visible layers are put into lists of the damaged tiles they
+  overlap (from bottom to top), in one go. A tile is then merged using the
+  scanline compositor, but only going over layers in its own list, and the
+  result (a few KB) stays in cache till it is written. Tiles are handed
+  out to threads in turn, so layers clustered in a part of the display are
+  spread over all threads, unlike bands.
+
+ *****************************************************************************/
+
+static void composeTile(SILBOX *box, SILFB *out, UINT ox, UINT oy) {
+  UINT tile;
+
+  /* area is always within a single tile */
+  tile=((box->miny-grender.oy)/SILTILESIZE)*grender.tilecols+(box->minx-grender.ox)/SILTILESIZE;
+  scanArea(box,out,ox,oy,grender.tilelayers+grender.tilefirst[tile],
+      grender.tilefirst[tile+1]-grender.tilefirst[tile]);
+}
+
+/* part of layer within framebuffer starting at ox,oy of display, in */
+/* framebuffer coordinates                                           */
+static UINT layerTiles(SILLYR *layer, SILFB *fb, UINT ox, UINT oy, 
+    int *minx, int *miny, int *maxx, int *maxy) {
+  if (!layerArea(layer,ox,oy,ox+fb->width,oy+fb->height,minx,miny,maxx,maxy)) return 0;
+  *minx-=(int)ox;
+  *miny-=(int)oy;
+  *maxx-=(int)ox;
+  *maxy-=(int)oy;
+  return 1;
+}
+
+static UINT binTiles(SILFB *fb, SILBOX *boxes, UINT cnt, UINT ox, UINT oy) {
+  SILLYR *layer;
+  BYTE *hit;
+  UINT *next;
+  UINT cols,rows,tiles,t;
+  int minx,miny,maxx,maxy;
+
+  cols=(fb->width+SILTILESIZE-1)/SILTILESIZE;
+  rows=(fb->height+SILTILESIZE-1)/SILTILESIZE;
+  tiles=cols*rows;
+  grender.tilecols=cols;
+  grender.tilecnt=0;
+  grender.tilefirst=calloc(tiles+1,sizeof(UINT));
+  grender.tileboxes=malloc(tiles*sizeof(SILBOX));
+  hit=calloc(tiles,1);
+  next=malloc(tiles*sizeof(UINT));
+  if ((NULL==grender.tilefirst)||(NULL==grender.tileboxes)||(NULL==hit)||(NULL==next)) {
+    free(hit);
+    free(next);
+    return 0;
+  }
+
+  /* mark damaged tiles. Tiles start at ox,oy of display, like framebuffer */
+  for (UINT i=0;i<cnt;i++) {
+    minx=(int)SIL_MAX(boxes[i].minx,ox)-(int)ox;
+    miny=(int)SIL_MAX(boxes[i].miny,oy)-(int)oy;
+    maxx=(int)SIL_MIN(boxes[i].minx+boxes[i].width,ox+fb->width)-(int)ox;
+    maxy=(int)SIL_MIN(boxes[i].miny+boxes[i].height,oy+fb->height)-(int)oy;
+    if ((minx>=maxx)||(miny>=maxy)) continue;
+    for (int ty=miny/SILTILESIZE;ty<=(maxy-1)/SILTILESIZE;ty++) {
+      for (int tx=minx/SILTILESIZE;tx<=(maxx-1)/SILTILESIZE;tx++) {
+        hit[ty*cols+tx]=1;
+      }
+    }
+  }
+
+  /* count layers per damaged tile, and turn that into start of list */
+  for (layer=glyr.bottom;layer;layer=layer->next) {
+    if (!layerTiles(layer,fb,ox,oy,&minx,&miny,&maxx,&maxy)) continue;
+    for (int ty=miny/SILTILESIZE;ty<=(maxy-1)/SILTILESIZE;ty++) {
+      for (int tx=minx/SILTILESIZE;tx<=(maxx-1)/SILTILESIZE;tx++) {
+        t=ty*cols+tx;
+        if (hit[t]) grender.tilefirst[t+1]++;
+      }
+    }
+  }
+  for (t=0;t<tiles;t++) {
+    grender.tilefirst[t+1]+=grender.tilefirst[t];
+    next[t]=grender.tilefirst[t];
+  }
+
+  /* fill lists, from bottom to top */
+  grender.tilelayers=malloc((grender.tilefirst[tiles]+1)*sizeof(SILLYR *));
+  if (NULL==grender.tilelayers) {
+    free(hit);
+    free(next);
+    return 0;
+  }
+  for (layer=glyr.bottom;layer;layer=layer->next) {
+    if (!layerTiles(layer,fb,ox,oy,&minx,&miny,&maxx,&maxy)) continue;
+    for (int ty=miny/SILTILESIZE;ty<=(maxy-1)/SILTILESIZE;ty++) {
+      for (int tx=minx/SILTILESIZE;tx<=(maxx-1)/SILTILESIZE;tx++) {
+        t=ty*cols+tx;
+        if (hit[t]) grender.tilelayers[next[t]++]=layer;
+      }
+    }
+  }
+
+  /* damaged tiles are the areas to compose */
+  for (t=0;t<tiles;t++) {
+    if (!hit[t]) continue;
+    grender.tileboxes[grender.tilecnt].minx=ox+(t%cols)*SILTILESIZE;
+    grender.tileboxes[grender.tilecnt].miny=oy+(t/cols)*SILTILESIZE;
+    grender.tileboxes[grender.tilecnt].width=SIL_MIN(SILTILESIZE,fb->width-(t%cols)*SILTILESIZE);
+    grender.tileboxes[grender.tilecnt].height=SIL_MIN(SILTILESIZE,fb->height-(t/cols)*SILTILESIZE);
+    grender.tilecnt++;
+  }
+  free(hit);
+  free(next);
+  return 1;
+}
+
+static void freeTiles() {
+  free(grender.tilefirst);
+  free(grender.tileboxes);
+  free(grender.tilelayers);
+  grender.tilefirst=NULL;
+  grender.tileboxes=NULL;
+  grender.tilelayers=NULL;
+  grender.tilecnt=0;
+}
+
+/*****************************************************************************
+
+  Internal function: redraw given area of display framebuffer. Displays of
+  other types then SILTYPE_ARGB are composed in a 32 bit working buffer,
+  SILWORKROWS rows at a time, and converted (and optionally dithered) once
+  into the display framebuffer. This avoids unpacking and packing every 
+  pixel for every layer, and keeps full colors while blending.
+
+ *****************************************************************************/
+
+static void composeBox(SILFB *fb, SILBOX *box, SILFB *work) {
+  void (*compose)(SILBOX *, SILFB *, UINT, UINT)=composeArea;
+  SILBOX area,part,rows;
+  UINT ox=grender.ox;
+  UINT oy=grender.oy;
+  UINT maxx,maxy;
+
+  if (SILCOMPOSE_SCANLINE==grender.mode) compose=composeScanlines;
+  if (grender.tiled) compose=composeTile;
+
+  /* keep area within framebuffer */
+  area.minx=SIL_MAX(box->minx,ox);
+  area.miny=SIL_MAX(box->miny,oy);
+  maxx=SIL_MIN(box->minx+box->width,ox+fb->width);
+  maxy=SIL_MIN(box->miny+box->height,oy+fb->height);
+  if ((area.minx>=maxx)||(area.miny>=maxy)) return;
+  area.width=maxx-area.minx;
+  area.height=maxy-area.miny;
+
+  if (NULL==work) {
+    compose(&area,fb,ox,oy);
+    return;
+  }
+  part.minx=area.minx;
+  part.width=area.width;
+  rows.minx=area.minx-ox;
+  rows.miny=0;
+  rows.width=area.width;
+  for (UINT y=area.miny;y<maxy;y+=rows.height) {
+    rows.height=SIL_MIN(maxy-y,work->height);
+    part.miny=y;
+    part.height=rows.height;
+    compose(&part,work,ox,y);
+    ConvertFB(work,fb,&rows,area.minx-ox,y-oy,grender.dither?SILCONV_DITHER:0);
+  }
+}
+
+/*****************************************************************************
+
+  Internal functions: compose given areas, split in horizontal bands when
+  using multiple threads. Every thread only writes in its own band, so 
+  there is no need for locking while composing. Nothing else may change 
+  layers or framebuffers meanwhile, since caller waits until all are done.
+  With SILCOMPOSE_TILE, areas are replaced by damaged tiles, and every
+  thread takes its own tiles instead of a band.
+
+ *****************************************************************************/
+
+static SILFB *bandWork(UINT band) {
+  return grender.jobwork?grender.jobwork[band]:NULL;
+}
+
+static void composeBand(SILFB *fb, SILBOX *boxes, UINT cnt, UINT band, UINT bands) {
+  SILBOX part;
+  UINT from,till;
+
+  if (grender.tiled) {
+    /* boxes are tiles, take every "bands"th one */
+    for (UINT i=band;i<cnt;i+=bands) composeBox(fb,&boxes[i],bandWork(band));
+    return;
+  }
+
+  for (UINT i=0;i<cnt;i++) {
+    from=(unsigned long long)boxes[i].height*band/bands;
+    till=(unsigned long long)boxes[i].height*(band+1)/bands;
+    if (from>=till) continue;
+    part.minx=boxes[i].minx;
+    part.width=boxes[i].width;
+    part.miny=boxes[i].miny+from;
+    part.height=till-from;
+    composeBox(fb,&part,bandWork(band));
+  }
+}
+
+static void *renderThread(void *arg) {
+  UINT band=(UINT)(uintptr_t)arg;
+  UINT job=0;  /* jobs are counted from 0 again, every time threads start */
+
+  pthread_mutex_lock(&grender.lock);
+  while (1) {
+    while ((job==grender.job)&&(!grender.quit)) pthread_cond_wait(&grender.start,&grender.lock);
+    if (grender.quit) break;
+    job=grender.job;
+    pthread_mutex_unlock(&grender.lock);
+
+    composeBand(grender.fb,grender.boxes,grender.boxcnt,band,grender.threads);
+
+    pthread_mutex_lock(&grender.lock);
+    if (0==--grender.busy) pthread_cond_signal(&grender.done);
+  }
+  pthread_mutex_unlock(&grender.lock);
+  return NULL;
+}
+
+static void composeBoxes(SILFB *fb, SILBOX *boxes, UINT cnt, UINT ox, UINT oy) {
+  grender.ox=ox;
+  grender.oy=oy;
+  if (SILCOMPOSE_TILE==grender.mode) {
+    /* compose damaged tiles instead (when there is enough memory for it) */
+    if (binTiles(fb,boxes,cnt,ox,oy)) {
+      grender.tiled=1;
+      boxes=grender.tileboxes;
+      cnt=grender.tilecnt;
+    }
+  }
+  if (grender.threads<2) {
+    for (UINT i=0;i<cnt;i++) composeBox(fb,&boxes[i],bandWork(0));
+  } else {
+    /* hand out job to other threads, and do first band ourself */
+    pthread_mutex_lock(&grender.lock);
+    grender.fb=fb;
+    grender.boxes=boxes;
+    grender.boxcnt=cnt;
+    grender.busy=grender.threads-1;
+    grender.job++;
+    pthread_cond_broadcast(&grender.start);
+    pthread_mutex_unlock(&grender.lock);
+
+    composeBand(fb,boxes,cnt,0,grender.threads);
+
+    /* wait till everybody is done */
+    pthread_mutex_lock(&grender.lock);
+    while (grender.busy) pthread_cond_wait(&grender.done,&grender.lock);
+    pthread_mutex_unlock(&grender.lock);
+  }
+  grender.tiled=0;
+  freeTiles();
+}
+
+/*****************************************************************************
+
+  Internal functions: free working buffers, or (re)create one for every 
+  thread when framebuffer isn't SILTYPE_ARGB. They are only recreated when
+  too small. When there is no memory for them, layers are merged directly
+  into framebuffer. Display and sil_composeRegion each have their own set,
+  so screenshots don't replace the ones of the display.
+
+ *****************************************************************************/
+
+static void freeWork(SILFB **work) {
+  for (UINT i=0;i<SILMAXTHREADS;i++) {
+    if (work[i]) sil_destroyFB(work[i]);
+    work[i]=NULL;
+  }
+}
+
+static SILFB **prepareWork(SILFB **work, SILFB *fb) {
+  if (SILTYPE_ARGB==fb->type) return NULL;
+  if ((work[0])&&(work[0]->width>=fb->width)) return work;
+  freeWork(work);
+  for (UINT i=0;i<grender.threads;i++) {
+    work[i]=sil_initFB(fb->width,SILWORKROWS,SILTYPE_ARGB);
+    if (NULL==work[i]) {
+      log_warn("Can't create working buffer for merging layers, merging directly into framebuffer");
+      freeWork(work);
+      return NULL;
+    }
+  }
+  return work;
+}
+
+/*****************************************************************************
+
+  Set number of threads used for merging layers into display framebuffer.
+  Display is split up in horizontal bands, one for each thread. Default is
+  1, all done by calling thread. Output is exactly the same, no matter how
+  many threads are used.
+
+  In: number of threads (including calling thread), 0 or 1 to stop using 
+      extra threads
+
+ *****************************************************************************/
+
+void sil_setRenderThreads(UINT threads) {
+  UINT started=0;
+
+  if (threads<1) threads=1;
+  if (threads>SILMAXTHREADS) threads=SILMAXTHREADS;
+
+  /* stop current threads first */
+  if (grender.ids) {
+    pthread_mutex_lock(&grender.lock);
+    grender.quit=1;
+    pthread_cond_broadcast(&grender.start);
+    pthread_mutex_unlock(&grender.lock);
+    for (UINT i=0;i<grender.threads-1;i++) pthread_join(grender.ids[i],NULL);
+    free(grender.ids);
+    grender.ids=NULL;
+    grender.quit=0;
+  }
+  freeWork(grender.work);
+  freeWork(grender.capwork);
+  grender.job=0;
+  grender.threads=1;
+  if (threads<2) {
+    sil_setErr(SILERR_ALLOK);
+    return;
+  }
+
+  if (!grender.init) {
+    pthread_mutex_init(&grender.lock,NULL);
+    pthread_cond_init(&grender.start,NULL);
+    pthread_cond_init(&grender.done,NULL);
+    grender.init=1;
+  }
+
+  /* make sure blending and converting functions are choosen before      */
+  /* threads use them                                                     */
+  InitBlend();
+  ConvertFB(NULL,NULL,NULL,0,0,0);
+
+  grender.ids=calloc(threads-1,sizeof(pthread_t));
+  if (NULL==grender.ids) {
+    log_info("ERR: Can't allocate memory for render threads");
+    sil_setErr(SILERR_NOMEM);
+    return;
+  }
+  for (UINT i=0;i<threads-1;i++) {
+    if (pthread_create(&grender.ids[i],NULL,renderThread,(void *)(uintptr_t)(i+1))) {
+      log_warn("Can't create render thread %d, using %d threads",i+1,i+1);
+      break;
+    }
+    started++;
+  }
+  if (0==started) {
+    free(grender.ids);
+    grender.ids=NULL;
+    sil_setErr(SILERR_NOMEM);
+    return;
+  }
+  grender.threads=started+1;
+  sil_setErr(SILERR_ALLOK);
+}
+
+/*****************************************************************************
+
+  Get number of threads used for merging layers into display framebuffer
+
+ *****************************************************************************/
+
+UINT sil_getRenderThreads() {
+  return grender.threads;
+}
+
+/*****************************************************************************
+
+  Set if ordered dithering is used when merged layers are converted to 
+  display framebuffer with less bits per color (like SILTYPE_565RGB). 
+  Default is off.
+
+  In: 0 = no dithering, otherwise dithering
+
+ *****************************************************************************/
+
+void sil_setRenderDither(BYTE dither) {
+  grender.dither=dither?1:0;
+  /* redraw everything, with or without dithering */
+  glyr.lastfb=NULL;
+  sil_setErr(SILERR_ALLOK);
+}
+
+/*****************************************************************************
+
+  Get if ordered dithering is used when merging layers into display
+
+ *****************************************************************************/
+
+BYTE sil_getRenderDither() {
+  return grender.dither;
+}
+
+/*****************************************************************************
+
+  Set the way layers are merged into display framebuffer. All give the same
+  result, but SILCOMPOSE_SCANLINE is faster for many small, overlapping 
+  layers, since every row of display is written only once, instead of once
+  for every layer on it. SILCOMPOSE_TILE does the same per tile, only
+  going over layers on that tile, and spreads tiles over all threads. 
+  Best choice when layers are clustered in a few parts of the display.
+
+  In: SILCOMPOSE_LAYER (default), SILCOMPOSE_SCANLINE or SILCOMPOSE_TILE
+
+ *****************************************************************************/
+
+void sil_setComposeMode(BYTE mode) {
+#ifndef SIL_LIVEDANGEROUS
+  if (mode>SILCOMPOSE_TILE) {
+    log_warn("Setting unknown compose mode (%d)",mode);
+    sil_setErr(SILERR_WRONGFORMAT);
+    return;
+  }
+#endif
+  grender.mode=mode;
+  sil_setErr(SILERR_ALLOK);
+}
+
+/*****************************************************************************
+
+  Get the way layers are merged into display framebuffer
+
+ *****************************************************************************/
+
+BYTE sil_getComposeMode() {
+  return grender.mode;
+}
+
+/*****************************************************************************
+
+  Internal function: check which layers are opaque (or have only fully 
+  opaque and invisible pixels), so layers underneath can be skipped or 
+  pixels can be copied instead of blended
+
+ *****************************************************************************/
+
+static void checkOpacity() {
+  SILLYR *layer;
+  BYTE opacity;
+
+  layer=sil_getBottom();
+  while (layer) {
+    layer->internal&=~(SILFLAG_OPAQUE|SILFLAG_BINARYALPHA);
+    if (layer->alpha>=1) {
+      opacity=sil_getOpacityFB(layer->fb);
+      if (SILOPACITY_ALPHA!=opacity) layer->internal|=SILFLAG_BINARYALPHA;
+      if ((SILOPACITY_OPAQUE==opacity)&&
+          (layer->view.minx+layer->view.width<=layer->fb->width)&&
+          (layer->view.miny+layer->view.height<=layer->fb->height)) {
+        layer->internal|=SILFLAG_OPAQUE;
+      }
+    }
+    layer=layer->next;
+  }
+}
+
 /*****************************************************************************
 
   draw all layers, from bottom till top, into a single Framebuffer
@@ -785,15 +1965,14 @@ SILLYR *sil_PNGtoNewLayer(char *filename,UINT x,UINT y) {
   However can be also be used for making screendumps, testing or generating
   image .png files
 
+  Only the damaged areas of the display -since last call- are redrawn. When 
+  called with a different framebuffer then last time, everything is redrawn.
+
  *****************************************************************************/
 
 void LayersToFB(SILFB *fb) {
   SILLYR *layer;
-  BYTE red,green,blue,alpha;
-  BYTE mixred,mixgreen,mixblue,mixalpha;
-  float af;
-  float negaf;
-  int absx,absy;
+  SILBOX all;
 
 #ifndef SIL_LIVEDANGEROUS
   if (0==fb->size) {
@@ -803,47 +1982,138 @@ void LayersToFB(SILFB *fb) {
   }
 #endif
 
+  /* framebuffer shares its pixels with a copy, get its own before band  */
+  /* threads write into it (they can't swap buffers while others write)  */
+  if ((fb->cow)&&(!UnshareFB(fb))) return;
+
+  /* changed parts of layers since last time are damaged as well */
   layer=sil_getBottom();
-  sil_clearFB(fb);
   while (layer) {
-    if (!(layer->flags&SILFLAG_INVISIBLE)) {
-     /*
-      if (sil_getBottom()==layer) log_debug("Bottom");
-      if (sil_getTop()==layer) log_debug("Top");
-      log_debug("Processing layer %d",layer->id);
-      */
-      for (int y=layer->view.miny; y<(layer->view.miny+layer->view.height); y++) {
-        for (int x=layer->view.minx; x<(layer->view.minx+layer->view.width); x++) {
-          int absx=x+layer->relx-layer->view.minx;
-          int absy=y+layer->rely-layer->view.miny;
-          int rx=x;
-          int ry=y;
-
-          /* prevent drawing outside borders of display */
-          if ((absx>fb->width)||(absy>fb->height)) continue;
-
-          sil_getPixelLayer(layer,rx,ry,&red,&green,&blue,&alpha);
-          if (0==alpha) continue; /* nothing to do if completely transparant */
-          alpha=alpha*layer->alpha;
-          if (255==alpha) {
-            sil_putPixelFB(fb,absx,absy,red,green,blue,255);
-          } else {
-            sil_getPixelFB(fb,absx,absy,&mixred,&mixgreen,&mixblue,&mixalpha);
-            af=((float)alpha)/255;
-            negaf=1-af;
-            red=red*af+negaf*mixred;
-            green=green*af+negaf*mixgreen;
-            blue=blue*af+negaf*mixblue;
-            sil_putPixelFB(fb,absx,absy,red,green,blue,255);
-          }
-        }
-      }
+    dirtyDamage(layer);
+    layer=layer->next;
+  }
+  checkOpacity();
+
+  /* display of SILTYPE_ARGB doesn't need working buffers, release them */
+  if (SILTYPE_ARGB==fb->type) freeWork(grender.work);
+  grender.jobwork=prepareWork(grender.work,fb);
+  if (fb!=glyr.lastfb) {
+    /* different framebuffer then last time, so redraw everything */
+    all.minx=0;
+    all.miny=0;
+    all.width=fb->width;
+    all.height=fb->height;
+    composeBoxes(fb,&all,1,0,0);
+    sil_addDirtyFB(fb,0,0,fb->width,fb->height);
+  } else {
+    composeBoxes(fb,glyr.damage,glyr.damaged,0,0);
+    for (UINT i=0;i<glyr.damaged;i++) {
+      sil_addDirtyFB(fb,glyr.damage[i].minx,glyr.damage[i].miny,glyr.damage[i].width,glyr.damage[i].height);
     }
+  }
+
+  /* all done, reset for next round. Note that framebuffers can be shared   */
+  /* between layers, so only clear after all layers have been checked      */
+  glyr.damaged=0;
+  glyr.lastfb=fb;
+  layer=sil_getBottom();
+  while (layer) {
+    sil_clearDirtyFB(layer->fb);
     layer=layer->next;
   }
   sil_setErr(SILERR_ALLOK);
 }
 
+/*****************************************************************************
+
+  Merge all visible layers within given area of display (x,y,width,height)
+  into framebuffer, with x,y of display at 0,0 of framebuffer. Area may be
+  outside of display itself. Uses the same compositor (and threads) as 
+  LayersToFB, but only for given area, regardless of damaged areas. 
+  Framebuffer can be of any type, except SILTYPE_EMPTY.
+  Used for screenshots (sil_saveDisplay, sil_screenCapture)
+
+  In: fb = framebuffer to draw in (should be at least width x height)
+      x,y = position of area on display
+      width,height = size of area
+  Out: SILERR_ALLOK or SILERR_NOTINIT
+
+ *****************************************************************************/
+
+UINT sil_composeRegion(SILFB *fb, UINT x, UINT y, UINT width, UINT height) {
+  SILBOX area;
+
+#ifndef SIL_LIVEDANGEROUS
+  if ((NULL==fb)||(0==fb->size)) {
+    log_warn("Trying to merge layers to uninitialized framebuffer");
+    sil_setErr(SILERR_NOTINIT);
+    return SILERR_NOTINIT;
+  }
+#endif
+
+  /* same as LayersToFB, unshare before any thread writes into it */
+  if ((fb->cow)&&(!UnshareFB(fb))) return sil_getErr();
+
+  checkOpacity();
+  grender.jobwork=prepareWork(grender.capwork,fb);
+  area.minx=x;
+  area.miny=y;
+  area.width=SIL_MIN(width,fb->width);
+  area.height=SIL_MIN(height,fb->height);
+  composeBoxes(fb,&area,1,x,y);
+  sil_addDirtyFB(fb,0,0,area.width,area.height);
+
+  sil_setErr(SILERR_ALLOK);
+  return SILERR_ALLOK;
+}
+
+/*****************************************************************************
+
+  Internal function: remember size of display, called by sil_initDisplay of
+  the display backends, since not all of them use LayersToFB (SDL)
+
+ *****************************************************************************/
+
+void SetDisplaySize(UINT width, UINT height) {
+  glyr.width=width;
+  glyr.height=height;
+}
+
+#ifndef SIL_W32
+/*****************************************************************************
+
+  Capture display and put it in a new layer (on top) for further use. 
+  Content is merged from all layers, using size of display.
+  (Windows GDI version, capturing whole screen, is in winGDIdisplay.c)
+
+ *****************************************************************************/
+
+SILLYR *sil_screenCapture() {
+  SILLYR *lyr;
+
+#ifndef SIL_LIVEDANGEROUS
+  if ((0==glyr.width)||(0==glyr.height)) {
+    log_warn("Can't capture display, it hasn't been initialized yet");
+    sil_setErr(SILERR_NOTINIT);
+    return NULL;
+  }
+#endif
+
+  lyr=sil_addLayer(0,0,glyr.width,glyr.height,SILTYPE_ARGB);
+  if (NULL==lyr) {
+    log_warn("Can't create layer for screenshot");
+    return NULL;
+  }
+
+  /* new layer itself shouldn't be part of it */
+  lyr->flags|=SILFLAG_INVISIBLE;
+  sil_composeRegion(lyr->fb,0,0,glyr.width,glyr.height);
+  lyr->flags&=~SILFLAG_INVISIBLE;
+  sil_setErr(SILERR_ALLOK);
+  return lyr;
+}
+#endif
+
 /*****************************************************************************
 
   if mousebutton has been clicked, find the highest layer that is right under 
@@ -1147,6 +2417,9 @@ void sil_toTop(SILLYR *layer) {
   /* don't move when already on top */
   if (glyr.top==layer) return;
 
+  /* stacking order only matters where layer is placed */
+  layerDamage(layer);
+
   tnext=layer->next;
   tprevious=layer->previous;
   
@@ -1176,6 +2449,9 @@ void sil_toBottom(SILLYR *layer) {
   /* don't move when already on bottom */
   if (glyr.bottom==layer) return;
 
+  /* stacking order only matters where layer is placed */
+  layerDamage(layer);
+
   tnext=layer->next;
   tprevious=layer->previous;
   
@@ -1210,6 +2486,9 @@ void sil_toAbove(SILLYR *layer,SILLYR *target) {
   /* don't move when already on position */
   if (layer->previous==target) return;
 
+  /* stacking order only matters where layer is placed */
+  layerDamage(layer);
+
   tnext=target->next;
   tprevious=target->previous;
   lnext=layer->next;
@@ -1269,6 +2548,9 @@ void sil_toBelow(SILLYR *layer,SILLYR *target) {
   /* don't move when already on position */
   if (layer->next==target) return;
 
+  /* stacking order only matters where layer is placed */
+  layerDamage(layer);
+
   tnext=target->next;
   tprevious=target->previous;
   lnext=layer->next;
@@ -1331,6 +2613,8 @@ void sil_swap(SILLYR *layer,SILLYR *target) {
     /* swap with yourself ? nothing to do */
     return;
   }
+  layerDamage(layer);
+  layerDamage(target);
 
   if (glyr.top==target) {
     glyr.top=layer;
@@ -1416,10 +2700,12 @@ static void copylayerinfo(SILLYR *from, SILLYR *to) {
 
   addCopy : creates a new layer, but copies all layer information to new one
             New layer will be placed at given x,y postion
+            Pixels are shared until one of both is drawn into, see sil_copyFB
 
  *****************************************************************************/
 SILLYR *sil_addCopy(SILLYR *layer,UINT relx,UINT rely) {
   SILLYR *ret=NULL;
+  SILFB *fb;
 
 #ifndef SIL_LIVEDANGEROUS
   if ((NULL==layer)||(NULL==layer->fb)||(0==layer->fb->size)) {
@@ -1428,13 +2714,23 @@ SILLYR *sil_addCopy(SILLYR *layer,UINT relx,UINT rely) {
     return NULL;
   }
 #endif
-  ret=sil_addLayer(relx,rely,layer->fb->width,layer->fb->height,layer->fb->type);
+  /* create layer of size 1x1, since fb will be replaced by copy */
+  ret=sil_addLayer(relx,rely,1,1,layer->fb->type);
   if (NULL==ret) {
     log_warn("Can't create extra layer for addCopy");
     return NULL;
   }
-  memcpy(ret->fb->buf,layer->fb->buf,layer->fb->size);
+  fb=sil_copyFB(layer->fb);
+  if (NULL==fb) {
+    log_warn("Can't copy framebuffer for addCopy");
+    sil_destroyLayer(ret);
+    sil_setErr(SILERR_NOMEM);
+    return NULL;
+  }
+  sil_destroyFB(ret->fb);
+  ret->fb=fb;
   copylayerinfo(layer,ret);
+  layerDamage(ret);
   sil_setErr(SILERR_ALLOK);
 
   return ret;
@@ -1465,14 +2761,12 @@ SILLYR *sil_addInstance(SILLYR *layer,UINT relx,UINT rely) {
     log_warn("Can't create extra layer for addCopy");
     return NULL;
   }
-  free(ret->fb);
+  sil_destroyFB(ret->fb);
   ret->fb=layer->fb;
+  ret->fb->refs++;
 
   copylayerinfo(layer,ret);
-  /* set flag to instanciated, preventing throwing away framebuffer */
-  /* if there is still a copy of it left                            */
-  layer->internal|=SILFLAG_INSTANCIATED;
-  ret->internal|=SILFLAG_INSTANCIATED;
+  layerDamage(ret);
   sil_setErr(SILERR_ALLOK);
   return ret;
 }
@@ -23,6 +23,7 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -50,6 +51,12 @@ typedef struct _GDISP {
   int fevent;
   UINT lastx;
   UINT lasty;
+  BYTE direct;  /* framebuffer of display is display memory itself */
+  BYTE flip;    /* using two pages of display memory, see below      */
+  BYTE page;    /* page currently merged into, other one is visible  */
+  SILBOX damage[SILMAXDIRTY]; /* changed areas of previous update    */
+  UINT damaged;
+  struct fb_var_screeninfo orgvinfo;
 } GDISP;
 
 static GDISP gdisp;
@@ -87,6 +94,9 @@ UINT sil_initDisplay(void *hI, UINT width, UINT height, char *title) {
   FILE *fp;
   int fd=0;
   char name[256]="unknown";
+  UINT bytes;
+  UINT size;
+  SILFB *fb;
 
 
 
@@ -104,6 +114,19 @@ UINT sil_initDisplay(void *hI, UINT width, UINT height, char *title) {
     log_warn("ERR: Can't get framebuffer device variable info");
     return SILERR_NOTINIT;
   }
+  memcpy(&gdisp.orgvinfo,&gdisp.vinfo,sizeof(gdisp.vinfo));
+
+#ifndef SIL_FBNOFLIP
+  /* page flipping needs room for two screens, ask for it if not there */
+  if (gdisp.vinfo.yres_virtual<2*gdisp.vinfo.yres) {
+    gdisp.vinfo.yres_virtual=2*gdisp.vinfo.yres;
+    if ((-1==ioctl(gdisp.fbfd, FBIOPUT_VSCREENINFO, &gdisp.vinfo))||
+        (-1==ioctl(gdisp.fbfd, FBIOGET_FSCREENINFO, &gdisp.finfo))) {
+      log_info("Can't get enough display memory for page flipping");
+    }
+    ioctl(gdisp.fbfd, FBIOGET_VSCREENINFO, &gdisp.vinfo);
+  }
+#endif
   gdisp.screensize = gdisp.finfo.smem_len;
 
   gdisp.fbp=(BYTE *)mmap(NULL,gdisp.screensize,PROT_READ|PROT_WRITE,MAP_SHARED,gdisp.fbfd,0);
@@ -175,6 +198,51 @@ UINT sil_initDisplay(void *hI, UINT width, UINT height, char *title) {
     sil_setErr(SILERR_NOMEM);
     return SILERR_NOMEM;
   }
+  SetDisplaySize(gdisp.vinfo.xres,gdisp.vinfo.yres);
+
+  /* can layers be merged directly into display memory ? Only if pixels   */
+  /* use whole bytes, rows of display memory are used as rows of           */
+  /* framebuffer, including padding at the end of them                     */
+  gdisp.direct=0;
+  gdisp.flip=0;
+  bytes=gdisp.vinfo.bits_per_pixel/8;
+  if ((0==gdisp.vinfo.bits_per_pixel%8)&&
+      (gdisp.finfo.line_length>=gdisp.vinfo.xres*bytes)) {
+    size=gdisp.finfo.line_length*gdisp.vinfo.yres;
+
+#ifndef SIL_FBNOFLIP
+    /* merge into page that isn't visible and show it when done, first    */
+    /* page 0 is shown, so start merging into page 1                      */
+    if ((gdisp.vinfo.yres_virtual>=2*gdisp.vinfo.yres)&&
+        (2*size<=gdisp.screensize)) {
+      gdisp.vinfo.xoffset=0;
+      gdisp.vinfo.yoffset=0;
+      if (-1==ioctl(gdisp.fbfd, FBIOPAN_DISPLAY, &gdisp.vinfo)) {
+        log_info("Can't switch pages of display memory");
+      } else if (NULL!=(fb=sil_wrapFB(gdisp.fbp+size,gdisp.vinfo.xres,gdisp.vinfo.yres,gdisp.finfo.line_length,type))) {
+        ReplaceFB(gdisp.fb,fb);
+        gdisp.page=1;
+        gdisp.damaged=0;
+        gdisp.flip=1;
+        gdisp.direct=1;
+        log_info("Using page flipping");
+      }
+    }
+#endif
+
+#ifdef SIL_FBDIRECT
+    if ((!gdisp.flip)&&
+        (gdisp.vinfo.yoffset*gdisp.finfo.line_length+size<=gdisp.screensize)) {
+      fb=sil_wrapFB(gdisp.fbp+gdisp.vinfo.yoffset*gdisp.finfo.line_length+gdisp.vinfo.xoffset*bytes,
+        gdisp.vinfo.xres,gdisp.vinfo.yres,gdisp.finfo.line_length,type);
+      if (fb) {
+        ReplaceFB(gdisp.fb,fb);
+        gdisp.direct=1;
+        log_info("Merging layers directly into display memory");
+      }
+    }
+#endif
+  }
 
   /* stop cursor */
   fd =open("/dev/tty0",O_RDWR);
@@ -206,19 +274,104 @@ UINT sil_initDisplay(void *hI, UINT width, UINT height, char *title) {
   return SILERR_ALLOK;
 }
 
+/*****************************************************************************
+  
+  Internal function: update display using page flipping. Layers are merged
+  into the page that isn't visible, which will be shown when done (tear 
+  free). That page still contains the display of two updates ago, so 
+  besides the changes since last update, also changes made during last
+  update have to be redrawn.
+  Use directive -D SIL_FBVSYNC to wait for vertical sync before switching.
+
+ *****************************************************************************/
+
+static void flipDisplay() {
+  BYTE *visible;
+
+  gdisp.fb->buf=gdisp.fbp+gdisp.page*gdisp.fb->size;
+  for (UINT i=0;i<gdisp.damaged;i++) {
+    sil_addDamage(gdisp.damage[i].minx,gdisp.damage[i].miny,gdisp.damage[i].width,gdisp.damage[i].height);
+  }
+  LayersToFB(gdisp.fb);
+
+  /* remember changes for next update */
+  memcpy(gdisp.damage,gdisp.fb->dirty,sizeof(gdisp.damage));
+  gdisp.damaged=gdisp.fb->dirtycnt;
+  sil_clearDirtyFB(gdisp.fb);
+
+#ifdef SIL_FBVSYNC
+  {
+    __u32 crtc=0;
+    ioctl(gdisp.fbfd, FBIO_WAITFORVSYNC, &crtc);
+  }
+#endif
+  gdisp.vinfo.yoffset=gdisp.page*gdisp.vinfo.yres;
+  if (-1==ioctl(gdisp.fbfd, FBIOPAN_DISPLAY, &gdisp.vinfo)) {
+    /* stop flipping, copy page to visible one and merge directly there */
+    log_warn("Can't switch pages of display memory, stop flipping pages");
+    gdisp.vinfo.yoffset=0;
+    visible=gdisp.fbp;
+    if (gdisp.fb->buf!=visible) memcpy(visible,gdisp.fb->buf,gdisp.fb->size);
+    gdisp.fb->buf=visible;
+    gdisp.flip=0;
+    return;
+  }
+  gdisp.page^=1;
+}
+
 /*****************************************************************************
   
   Update Display
 
  *****************************************************************************/
 void sil_updateDisplay() {
+  SILBOX *box;
+  UINT bytes;
+  BYTE *src;
+  BYTE *dst;
+
+  if (gdisp.flip) {
+    flipDisplay();
+    return;
+  }
 
   /* get all layerinformation into a single fb */
   LayersToFB(gdisp.fb);
+  if (gdisp.direct) {
+    /* already there */
+    sil_clearDirtyFB(gdisp.fb);
+    return;
+  }
 
-  /* and just copy it */
-  memcpy(gdisp.fbp,gdisp.fb->buf,gdisp.screensize);
+  /* pixels not starting at byte boundaries (444), just copy all rows */
+  bytes=gdisp.vinfo.bits_per_pixel/8;
+  if (gdisp.vinfo.bits_per_pixel%8) {
+    src=gdisp.fb->buf;
+    dst=gdisp.fbp+gdisp.vinfo.yoffset*gdisp.finfo.line_length;
+    for (UINT y=0;y<gdisp.fb->height;y++) {
+      if (dst+gdisp.finfo.line_length>gdisp.fbp+gdisp.screensize) break;
+      memcpy(dst,src,SIL_MIN(gdisp.fb->stride,gdisp.finfo.line_length));
+      src+=gdisp.fb->stride;
+      dst+=gdisp.finfo.line_length;
+    }
+    sil_clearDirtyFB(gdisp.fb);
+    return;
+  }
 
+  /* copy only changed areas, row by row, since rows of display memory can */
+  /* be longer then the visible part                                        */
+  for (UINT i=0;i<gdisp.fb->dirtycnt;i++) {
+    box=&gdisp.fb->dirty[i];
+    src=gdisp.fb->buf+box->miny*gdisp.fb->stride+box->minx*bytes;
+    dst=gdisp.fbp+(box->miny+gdisp.vinfo.yoffset)*gdisp.finfo.line_length+
+        (box->minx+gdisp.vinfo.xoffset)*bytes;
+    for (UINT y=0;y<box->height;y++) {
+      memcpy(dst,src,box->width*bytes);
+      src+=gdisp.fb->stride;
+      dst+=gdisp.finfo.line_length;
+    }
+  }
+  sil_clearDirtyFB(gdisp.fb);
 }
 
 /*****************************************************************************
@@ -229,7 +382,12 @@ void sil_updateDisplay() {
 void sil_destroyDisplay() { 
   int fd;
 
-  if (gdisp.fb->type) sil_destroyFB(gdisp.fb);
+  /* when merging directly, display memory isn't released by this */
+  if ((gdisp.fb)&&(gdisp.fb->type)) sil_destroyFB(gdisp.fb);
+  gdisp.fb=NULL;
+
+  /* back to original virtual size and visible page */
+  ioctl(gdisp.fbfd, FBIOPUT_VSCREENINFO, &gdisp.orgvinfo);
   if (gdisp.fevent) close(gdisp.fevent);
   fd =open("/dev/tty0",O_RDWR);
   if (fd) { 
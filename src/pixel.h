@@ -0,0 +1,150 @@
+#ifndef PIXEL_H
+#define PIXEL_H
+
+#include <string.h>
+
+/*
+
+   pixel.h CopyRight 2021 Remco Schellekens, see LICENSE for more details.
+
+   Internal header: accessors and span functions for every framebuffer type
+   that stores its pixels as bitfields in 1 to 4 bytes, lowest byte first.
+   All of them are generated from the single list below, so adding a type
+   (or fixing one) is done on one line instead of in every function.
+
+   For every type NAME this gives:
+   - sil_put_NAME(p,rgba)      : store one RGBA pixel at p
+   - sil_get_NAME(p,rgba)      : read one pixel at p into RGBA
+   - sil_putSpan_NAME(p,rgba,n): store n RGBA pixels, starting at p
+   - sil_getSpan_NAME(p,rgba,n): read n pixels, starting at p, into RGBA
+   Types without alpha return 255 as alpha. Colors are stored by dropping
+   the lowest bits and read back without filling them in again, the same
+   way for all types.
+
+   Types with pixels that don't fit this (444, premultiplied, palette and
+   alpha only) are handled by SpanToFB / FBToSpan in framebuffer.c itself.
+
+   It also holds the integer math used for all blending. Values from 0 to
+   255 are fractions of 255 (alpha, coverage, color), so multiplying two of
+   them means dividing by 255 afterwards. No floating point is needed, 
+   which is slow (or missing) on small CPU's.
+
+*/
+
+/* divide by 255 with rounding, without doing a division; exact for all    */
+/* values till 255*255                                                     */
+static inline UINT sil_div255(UINT x) {
+  x+=128;
+  return (x+(x>>8))>>8;
+}
+
+/* multiply two values of 0-255, like color with alpha, rounded            */
+static inline BYTE sil_mul255(UINT a, UINT b) {
+  return sil_div255(a*b);
+}
+
+/* blend value a over b with alpha (0-255), rounded                        */
+static inline BYTE sil_lerp255(UINT a, UINT b, UINT alpha) {
+  return sil_div255(a*alpha+b*(255-alpha));
+}
+
+/* per type: name, bytes per pixel and for red, green, blue and alpha the  */
+/* number of bits and position of lowest bit (0 bits = not stored)         */
+#define SILPIXEL_TYPES(X) \
+  X(332RGB, 1, 3,5,  3,2, 2,0,  0,0 ) \
+  X(332BGR, 1, 2,0,  3,2, 3,5,  0,0 ) \
+  X(555RGB, 2, 5,1,  5,6, 5,11, 0,0 ) \
+  X(555BGR, 2, 5,11, 5,6, 5,1,  0,0 ) \
+  X(565RGB, 2, 5,0,  6,5, 5,11, 0,0 ) \
+  X(565BGR, 2, 5,11, 6,5, 5,0,  0,0 ) \
+  X(666RGB, 3, 6,16, 6,8, 6,0,  0,0 ) \
+  X(666BGR, 3, 6,0,  6,8, 6,16, 0,0 ) \
+  X(888RGB, 3, 8,16, 8,8, 8,0,  0,0 ) \
+  X(888BGR, 3, 8,0,  8,8, 8,16, 0,0 ) \
+  X(ABGR,   4, 8,0,  8,8, 8,16, 8,24) \
+  X(ARGB,   4, 8,16, 8,8, 8,0,  8,24)
+
+/* color value (0-255) to bitfield and back */
+#define SILPIXEL_PACK(c,bits,shift) \
+  ((bits)?((UINT)((c)>>(8-(bits)))<<(shift)):0)
+#define SILPIXEL_UNPACK(v,bits,shift,none) \
+  ((bits)?(BYTE)((((v)>>(shift))&((1u<<(bits))-1))<<(8-(bits))):(none))
+
+/* read or write pixel of 1 to 4 bytes, lowest byte first */
+static inline UINT sil_loadPixel(const BYTE *p, UINT bytes) {
+  UINT v=p[0];
+
+  if (bytes>1) v|=(UINT)p[1]<<8;
+  if (bytes>2) v|=(UINT)p[2]<<16;
+  if (bytes>3) v|=(UINT)p[3]<<24;
+  return v;
+}
+
+static inline void sil_storePixel(BYTE *p, UINT v, UINT bytes) {
+  p[0]=v;
+  if (bytes>1) p[1]=v>>8;
+  if (bytes>2) p[2]=v>>16;
+  if (bytes>3) p[3]=v>>24;
+}
+
+/* same byte order as span itself (red, green, blue, alpha) */
+#define SILPIXEL_ASSPAN(BYTES,RB,RS,GB,GS,BB,BS,AB,AS) \
+  ((4==(BYTES))&&(8==(RB))&&(0==(RS))&&(8==(GB))&&(8==(GS))&& \
+   (8==(BB))&&(16==(BS))&&(8==(AB))&&(24==(AS)))
+
+/* every color is a whole byte, so it can be read and written directly */
+#define SILPIXEL_BYTEWISE(RB,GB,BB,AB) \
+  ((8==(RB))&&(8==(GB))&&(8==(BB))&&((0==(AB))||(8==(AB))))
+
+#define SILPIXEL_FUNCTIONS(NAME,BYTES,RB,RS,GB,GS,BB,BS,AB,AS) \
+static inline void sil_put_##NAME(BYTE *p, const BYTE *rgba) { \
+  if (SILPIXEL_BYTEWISE(RB,GB,BB,AB)) { \
+    p[(RS)/8]=rgba[0]; \
+    p[(GS)/8]=rgba[1]; \
+    p[(BS)/8]=rgba[2]; \
+    if (AB) p[(AS)/8]=rgba[3]; \
+    return; \
+  } \
+  sil_storePixel(p,SILPIXEL_PACK(rgba[0],RB,RS)|SILPIXEL_PACK(rgba[1],GB,GS)| \
+                   SILPIXEL_PACK(rgba[2],BB,BS)|SILPIXEL_PACK(rgba[3],AB,AS),BYTES); \
+} \
+static inline void sil_get_##NAME(const BYTE *p, BYTE *rgba) { \
+  UINT v; \
+  if (SILPIXEL_BYTEWISE(RB,GB,BB,AB)) { \
+    rgba[0]=p[(RS)/8]; \
+    rgba[1]=p[(GS)/8]; \
+    rgba[2]=p[(BS)/8]; \
+    rgba[3]=(AB)?p[(AS)/8]:255; \
+    return; \
+  } \
+  v=sil_loadPixel(p,BYTES); \
+  rgba[0]=SILPIXEL_UNPACK(v,RB,RS,0); \
+  rgba[1]=SILPIXEL_UNPACK(v,GB,GS,0); \
+  rgba[2]=SILPIXEL_UNPACK(v,BB,BS,0); \
+  rgba[3]=SILPIXEL_UNPACK(v,AB,AS,255); \
+} \
+static inline void sil_putSpan_##NAME(BYTE *p, BYTE *rgba, UINT n) { \
+  if (SILPIXEL_ASSPAN(BYTES,RB,RS,GB,GS,BB,BS,AB,AS)) { \
+    memcpy(p,rgba,n*4); \
+    return; \
+  } \
+  for (UINT i=0;i<n;i++,p+=BYTES,rgba+=4) sil_put_##NAME(p,rgba); \
+} \
+static inline void sil_getSpan_##NAME(BYTE *p, BYTE *rgba, UINT n) { \
+  if (SILPIXEL_ASSPAN(BYTES,RB,RS,GB,GS,BB,BS,AB,AS)) { \
+    memcpy(rgba,p,n*4); \
+    return; \
+  } \
+  for (UINT i=0;i<n;i++,p+=BYTES,rgba+=4) sil_get_##NAME(p,rgba); \
+}
+
+SILPIXEL_TYPES(SILPIXEL_FUNCTIONS)
+
+/* span function, to select once for a type and use for a whole operation  */
+typedef void (*SILSPANFUNC)(BYTE *, BYTE *, UINT);
+
+/* framebuffer.c, NULL for types not in list above */
+SILSPANFUNC PutSpanFunc(BYTE);
+SILSPANFUNC GetSpanFunc(BYTE);
+
+#endif /* PIXEL_H */
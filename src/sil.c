@@ -63,6 +63,7 @@ UINT sil_initSIL(UINT width, UINT height, char *title, void *hInstance) {
 
   /* initialize other globals */
   sil_initDraw();
+  InitBlend();
   return ret;
 }
 
@@ -131,14 +132,12 @@ void sil_mainLoop() {
             se->type=SILDISP_MOUSE_DRAG;
             se->layer=gsil.ActiveLayer;
             if (gsil.ActiveLayer->drag(se)) {
-              gsil.ActiveLayer->relx=se->x;
-              gsil.ActiveLayer->rely=se->y;
+              sil_placeLayer(gsil.ActiveLayer,se->x,se->y);
               sil_updateDisplay();
             }
           } else {
             /* no draghandler defined, just drag it */
-            gsil.ActiveLayer->relx=se->x;
-            gsil.ActiveLayer->rely=se->y;
+            sil_placeLayer(gsil.ActiveLayer,se->x,se->y);
             sil_updateDisplay();
           }
           /*  */
@@ -316,6 +315,7 @@ UINT sil_getTimeval() {
  *****************************************************************************/
 
 void sil_destroySIL() {
+  sil_setRenderThreads(1);
   sil_destroyDisplay();
   gsil.init=0;
 }
@@ -61,6 +61,37 @@ UINT sil_getTimeval();
 #define SILTYPE_ABGR     13
 #define SILTYPE_ARGB     14
 #define SILTYPE_EMPTY    15
+#define SILTYPE_PARGB    16  /* ARGB with colors premultiplied by alpha  */
+#define SILTYPE_PAL8     17  /* index in palette of 256 RGBA colors      */
+#define SILTYPE_A8       18  /* alpha only, color is palette entry 0     */
+#define SILTYPE_A1       19  /* 1 bit alpha only, color is palette entry 0*/
+
+/* maximum number of dirty areas remembered per framebuffer, more will be  */
+/* merged together into larger areas                                       */
+#define SILMAXDIRTY 8
+
+/* rows of framebuffers start at a multiple of this number of bytes, can be */
+/* changed with -D SIL_FBALIGN=... (should be a power of 2)                 */
+#ifndef SIL_FBALIGN
+#define SIL_FBALIGN 16
+#endif
+
+/* number of pixels handled at once by span functions using a buffer on    */
+/* stack, longer rows are done in multiple chunks                           */
+#define SILSPANCHUNK 256
+
+typedef struct _SILBOX {
+  UINT minx;
+  UINT miny;
+  UINT width;
+  UINT height;
+} SILBOX;
+
+/* memory holding pixels, shared by framebuffer and views on it */
+typedef struct _SILMEM {
+  BYTE *data;
+  UINT refs;                 /* number of framebuffers using it            */
+} SILMEM;
 
 typedef struct _SILFB {
   BYTE *buf;
@@ -68,15 +99,71 @@ typedef struct _SILFB {
   UINT height;
   BYTE type;
   UINT size;
-  BYTE changed;
+  UINT stride;               /* bytes from start of one row to the next    */
+  SILMEM *mem;               /* NULL if buf isn't owned, see sil_wrapFB    */
+  BYTE cow;                  /* mem shared with copies, see sil_copyFB     */
+  UINT refs;                 /* number of users (layers), see sil_destroyFB*/
+  SILBOX dirty[SILMAXDIRTY]; /* areas changed since last sil_clearDirtyFB */
+  UINT dirtycnt;
+  BYTE opacity;              /* cached result of sil_getOpacityFB          */
+  BYTE *pal;                 /* 256 RGBA colors for PAL8 (A8/A1), or NULL  */
 } SILFB;
 
+/* opacity classes of framebuffer, from best to worst */
+#define SILOPACITY_UNKNOWN 0  /* not determined yet                         */
+#define SILOPACITY_OPAQUE  1  /* no transparency at all                     */
+#define SILOPACITY_BINARY  2  /* pixels are either fully opaque or invisible */
+#define SILOPACITY_ALPHA   3  /* partly transparent pixels                   */
+
 
 SILFB *sil_initFB(UINT,UINT,BYTE) ;
+SILFB *sil_wrapFB(BYTE *,UINT,UINT,UINT,BYTE);
+SILFB *sil_subFB(SILFB *,UINT,UINT,UINT,UINT);
+SILFB *sil_copyFB(SILFB *);
+SILFB *AdoptFB(BYTE *,UINT,UINT,UINT,BYTE);
+void ReplaceFB(SILFB *,SILFB *);
+UINT UnshareFB(SILFB *);
 void sil_putPixelFB(SILFB *,UINT,UINT,BYTE,BYTE,BYTE,BYTE);
 void sil_getPixelFB(SILFB *,UINT,UINT,BYTE *,BYTE *,BYTE *,BYTE *);
+void sil_setPaletteFB(SILFB *,BYTE,BYTE,BYTE,BYTE,BYTE);
+void sil_getPaletteFB(SILFB *,BYTE,BYTE *,BYTE *,BYTE *,BYTE *);
+void sil_putSpanFB(SILFB *,UINT,UINT,UINT,BYTE *);
+void sil_getSpanFB(SILFB *,UINT,UINT,UINT,BYTE *);
+void SpanToFB(SILFB *,UINT,UINT,UINT,BYTE *);
+void FBToSpan(SILFB *,UINT,UINT,UINT,BYTE *);
+void PreSpanToFB(SILFB *,UINT,UINT,UINT,BYTE *);
+void FBToPreSpan(SILFB *,UINT,UINT,UINT,BYTE *);
 void sil_clearFB(SILFB *);
 void sil_destroyFB(SILFB *);
+void sil_addBox(SILBOX *,UINT *,UINT,UINT,UINT,UINT,UINT);
+void sil_addDirtyFB(SILFB *,UINT,UINT,UINT,UINT);
+UINT sil_getDirtyFB(SILFB *,SILBOX *);
+void sil_clearDirtyFB(SILFB *);
+BYTE sil_getOpacityFB(SILFB *);
+UINT sil_isOpaqueFB(SILFB *);
+
+
+/* blend.c */
+
+#define SILBLEND_SCALAR   0 /* versions of blend functions, see BlendKernel */
+#define SILBLEND_SSE2     1
+#define SILBLEND_AVX2     2
+#define SILBLEND_NEON     3
+
+void sil_blendSpan(BYTE *,BYTE *,UINT,BYTE);
+void sil_blendPreSpan(BYTE *,BYTE *,UINT,BYTE);
+void sil_expandSpan(BYTE *,BYTE *,UINT,BYTE *);
+void sil_mixSpan(BYTE *,BYTE *,UINT);
+void InitBlend();
+UINT BlendKernel(BYTE);
+
+
+/* convert.c */
+
+#define SILCONV_DITHER 1  /* ordered dithering to types with less bits */
+
+UINT sil_convertFB(SILFB *,SILFB *,SILBOX *,UINT,UINT,BYTE);
+void ConvertFB(SILFB *,SILFB *,SILBOX *,UINT,UINT,BYTE);
 
 
 /* layer.c */
@@ -84,6 +171,29 @@ void sil_destroyFB(SILFB *);
 /* maximum number of layers, make sure its lower then max UINT */
 #define SILMAXLAYERS 1000
 
+/* maximum number of damaged areas remembered between display updates,     */
+/* more will be merged together into larger areas                          */
+#define SILMAXDAMAGE 16
+
+/* maximum number of opaque layers per area used to skip hidden parts of    */
+/* layers underneath them                                                   */
+#define SILMAXCOVER 16
+
+/* maximum number of threads used for merging layers into display          */
+#define SILMAXTHREADS 64
+
+/* number of rows merged at once in 32 bit working buffer, before they are */
+/* converted into display framebuffer of another type then SILTYPE_ARGB    */
+#define SILWORKROWS 32
+
+/* ways of merging layers into display framebuffer                         */
+#define SILCOMPOSE_LAYER    0  /* layer by layer (default)                  */
+#define SILCOMPOSE_SCANLINE 1  /* row by row, all layers on a row at once   */
+#define SILCOMPOSE_TILE     2  /* tile by tile, only layers on that tile    */
+
+/* width and height of tiles used by SILCOMPOSE_TILE                        */
+#define SILTILESIZE 32
+
 /* bitmask for flags */
 
 #define SILFLAG_INVISIBLE      1
@@ -100,7 +210,8 @@ void sil_destroyFB(SILFB *);
 #define SILFLAG_KEYEVENT       2
 #define SILKT_SINGLE           4
 #define SILKT_ONLYUP           8
-#define SILFLAG_INSTANCIATED  16
+#define SILFLAG_OPAQUE        32
+#define SILFLAG_BINARYALPHA   64
 
 /* also used by display.c */
 typedef struct _SILEVENT {
@@ -114,14 +225,6 @@ typedef struct _SILEVENT {
   struct _SILLYR *layer;
 } SILEVENT;
 
-
-typedef struct _SILBOX {
-  UINT minx;
-  UINT miny;
-  UINT width;
-  UINT height;
-} SILBOX;
-
 typedef struct _SILSPRITE {
   UINT width;
   UINT height;
@@ -160,6 +263,7 @@ SILLYR *sil_addLayer(UINT, UINT, UINT, UINT, BYTE);
 SILLYR *sil_mirrorLayer(SILLYR *, UINT, UINT);
 void sil_putPixelLayer(SILLYR *, UINT, UINT, BYTE, BYTE, BYTE, BYTE);
 void sil_blendPixelLayer(SILLYR *, UINT, UINT, BYTE, BYTE, BYTE, BYTE);
+void sil_blendSpanLayer(SILLYR *, UINT, UINT, UINT, BYTE *);
 void sil_putBigPixelLayer(SILLYR *, UINT, UINT, BYTE, BYTE, BYTE, BYTE);
 void sil_blendBigPixelLayer(SILLYR *, UINT, UINT, BYTE, BYTE, BYTE, BYTE);
 void sil_getPixelLayer(SILLYR *, UINT, UINT, BYTE *, BYTE *, BYTE *, BYTE *);
@@ -176,7 +280,18 @@ UINT sil_resizeLayer(SILLYR *, UINT,UINT,UINT,UINT);
 void sil_moveLayer(SILLYR *,int, int);
 void sil_placeLayer(SILLYR *,UINT, UINT);
 SILLYR *sil_PNGtoNewLayer(char *,UINT,UINT);
+SILLYR *sil_PNGtoNewLayerType(char *,UINT,UINT,BYTE);
 void LayersToFB(SILFB *);
+UINT sil_composeRegion(SILFB *, UINT, UINT, UINT, UINT);
+void SetDisplaySize(UINT, UINT);
+void sil_addDamage(UINT, UINT, UINT, UINT);
+void sil_damageLayer(SILLYR *);
+void sil_setRenderThreads(UINT);
+UINT sil_getRenderThreads();
+void sil_setRenderDither(BYTE);
+BYTE sil_getRenderDither();
+void sil_setComposeMode(BYTE);
+BYTE sil_getComposeMode();
 void sil_setKeyHandler(SILLYR *,UINT, BYTE, BYTE, UINT (*)(SILEVENT *));
 void sil_setClickHandler(SILLYR *,UINT (*)(SILEVENT *));
 void sil_setHoverHandler(SILLYR *,UINT (*)(SILEVENT *));
@@ -246,8 +361,9 @@ typedef struct _SILFKERNING {
 
 
 typedef struct _SILFONT {
-  /* font imnage */
-  BYTE *image;
+  /* font imnage, SILTYPE_A8 for fonts with only white or gray pixels */
+  SILFB *image;
+  BYTE alphacolor;  /* SILTYPE_A8 image: brightness of pixel is its alpha */
   UINT width;
   UINT height;
   /* Common parameters */
@@ -371,6 +487,11 @@ void sil_stopTimerDisplay();
 void sil_setCursor(BYTE);
 SILLYR *sil_screenCapture();
 
+/* headlessdisplay.c only */
+UINT sil_putEventDisplay(SILEVENT *);
+SILFB *sil_getFBDisplay();
+UINT sil_dumpDisplay(char *);
+
 /* bitmasks for keymodifiers/special keys */
 #define SILKM_SHIFT  1
 #define SILKM_ALT    2
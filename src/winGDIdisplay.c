@@ -269,7 +269,7 @@ UINT sil_initDisplay(void *hI, UINT width, UINT height, char *title) {
   gdisp.win.bitmapInfo->bmiHeader.biPlanes      = 1;
   gdisp.win.bitmapInfo->bmiHeader.biBitCount    = 32;
   gdisp.win.bitmapInfo->bmiHeader.biCompression = BI_BITFIELDS;
-  gdisp.win.bitmapInfo->bmiHeader.biWidth       = gdisp.fb->width;
+  gdisp.win.bitmapInfo->bmiHeader.biWidth       = gdisp.fb->stride/4; /* rows of fb can be padded */
   gdisp.win.bitmapInfo->bmiHeader.biHeight      = -gdisp.fb->height; /* yup, minus, from bottom to top */
   gdisp.win.bitmapInfo->bmiColors[0].rgbRed     = 0xff;
   gdisp.win.bitmapInfo->bmiColors[1].rgbGreen   = 0xff;
@@ -569,9 +569,16 @@ SILLYR *sil_screenCapture() {
   width=GetSystemMetrics(SM_CXVIRTUALSCREEN);
   height=GetSystemMetrics(SM_CYVIRTUALSCREEN);
 
-  /* init bitmap */
+  /* Create layer */
+  lyr=sil_addLayer(0,0,width,height,SILTYPE_ARGB);
+  if (NULL==lyr) {
+    log_warn("Can't create layer for screenshot");
+    return NULL;
+  }
+
+  /* init bitmap, as wide as (padded) rows of layer framebuffer */
   bi.biSize = sizeof(BITMAPINFOHEADER);
-  bi.biWidth = width;
+  bi.biWidth = lyr->fb->stride/4;
   bi.biHeight = -height;
   bi.biPlanes = 1;
   bi.biBitCount = 32;
@@ -581,14 +588,7 @@ SILLYR *sil_screenCapture() {
   bi.biYPelsPerMeter = 0;
   bi.biClrUsed = 0;
   bi.biClrImportant = 0;
-  hbwin =  CreateCompatibleBitmap(hdc,width,height);
-
-  /* Create layer */
-  lyr=sil_addLayer(0,0,width,height,SILTYPE_ARGB);
-  if (NULL==lyr) {
-    log_warn("Can't create layer for screenshot");
-    return NULL;
-  }
+  hbwin =  CreateCompatibleBitmap(hdc,lyr->fb->stride/4,height);
 
   /* get screen */
   SelectObject(hdcc,hbwin);
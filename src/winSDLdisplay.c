@@ -66,9 +66,8 @@ UINT sil_getTypefromDisplay() {
  *****************************************************************************/
 
 static void LayersToDisplay() {
-  SDL_Rect SR,DR;
-  UINT scratchw,scratchh;
-  BYTE red,green,blue,alpha;
+  SDL_Rect SR,DR,UR;
+  SILBOX dirty;
   BYTE red2,green2,blue2,alpha2;
 
   SILLYR *layer=sil_getBottom();
@@ -84,6 +83,8 @@ static void LayersToDisplay() {
         continue;
       }
       SDL_SetTextureBlendMode(layer->texture,SDL_BLENDMODE_BLEND);
+      /* new texture, so everything needs to be uploaded */
+      sil_addDirtyFB(layer->fb,0,0,layer->fb->width,layer->fb->height);
     }
     /* normally, we would alter every alpha value when copying pixels to destination framebuffer    */
     /* however, we don't do framebuffer handling directly, so we have to override it some other way */
@@ -92,43 +93,31 @@ static void LayersToDisplay() {
       layer->internal^=SILFLAG_ALPHACHANGED;
     }
     if (!(layer->flags&SILFLAG_INVISIBLE)) {
-      if (layer->fb->changed) {
+      if (sil_getDirtyFB(layer->fb,&dirty)) {
+        /* only upload the part that has been changed since last time */
+        UR.x=dirty.minx;
+        UR.y=dirty.miny;
+        UR.w=dirty.width;
+        UR.h=dirty.height;
         if (layer->fb->type==SILTYPE_ARGB) {
-          SDL_UpdateTexture(layer->texture,NULL,layer->fb->buf,(layer->fb->width)*4);
+          SDL_UpdateTexture(layer->texture,&UR,layer->fb->buf+dirty.miny*layer->fb->stride+dirty.minx*4,layer->fb->stride);
         } else {
-          /* not ARGB , convert it to ARGB                                                 */
-          /* use scratch buffer, but to do so, alter its width & height temporarly         */
+          /* not ARGB , convert changed area to ARGB into top-left corner of scratch buffer */
           
-          /* if scratch isn't large enough to fit layer, recreate a new one */
-          if ((layer->fb->width>gdisp.scratch->width)||(layer->fb->height>gdisp.scratch->height)) {
+          /* if scratch isn't large enough to fit changed area, recreate a new one */
+          if ((dirty.width>gdisp.scratch->width)||(dirty.height>gdisp.scratch->height)) {
             sil_destroyFB(gdisp.scratch);
-            gdisp.scratch=sil_initFB(layer->fb->width,layer->fb->height,SILTYPE_ARGB);
+            gdisp.scratch=sil_initFB(dirty.width,dirty.height,SILTYPE_ARGB);
             if (NULL==gdisp.scratch) {
               log_info("ERR: Can't create resized scratch framebuffer for display");
               sil_setErr(SILERR_NOTINIT);
               return;
             }
           }
-
-          /* we adjust width height temporary for smaller framebufs */
-          scratchw=gdisp.scratch->width;
-          scratchh=gdisp.scratch->height;
-
-          if (gdisp.scratch->width>layer->fb->width) gdisp.scratch->width=layer->fb->width;
-          if (gdisp.scratch->height>layer->fb->height) gdisp.scratch->height=layer->fb->height;
-          for (UINT x=0;x<gdisp.scratch->width;x++) {
-            for (UINT y=0;y<gdisp.scratch->height;y++) {
-                sil_getPixelLayer(layer,x,y,&red,&green,&blue,&alpha);            
-                sil_putPixelFB(gdisp.scratch,x,y,red,green,blue,alpha);
-            }
-          }
-          SDL_UpdateTexture(layer->texture,NULL,gdisp.scratch->buf,gdisp.scratch->width*4);
-
-          /* ...and we set the dimensions back to latest size.. */
-          gdisp.scratch->width=scratchw;
-          gdisp.scratch->height=scratchh;
+          sil_convertFB(layer->fb,gdisp.scratch,&dirty,0,0,0);
+          SDL_UpdateTexture(layer->texture,&UR,gdisp.scratch->buf,gdisp.scratch->stride);
         }
-        layer->fb->changed=0;
+        sil_clearDirtyFB(layer->fb);
       }
       SR.x=layer->view.minx;
       SR.y=layer->view.miny;
@@ -183,6 +172,7 @@ UINT sil_initDisplay(void *nop, UINT width, UINT height, char *title) {
     sil_setErr(SILERR_NOTINIT);
     return SILERR_NOTINIT;
   }
+  SetDisplaySize(width,height);
 
   /* Raise created window */
   SDL_RaiseWindow(gdisp.window);
@@ -23,6 +23,10 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/cursorfont.h>
+#include <X11/extensions/XShm.h>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
 #include <sys/time.h>
 #include <stdint.h>
@@ -44,7 +48,11 @@ typedef struct _GDISP {
   Visual    *visual;
   int       screen;
   XImage    *ximage;
-  XGCValues gcvalues;
+  XShmSegmentInfo shminfo;
+  BYTE      useshm;   /* ximage lives in shared memory (MIT-SHM)           */
+  BYTE      shmbusy;  /* X server still busy reading shared memory         */
+  BYTE      shmfail;  /* attaching shared memory failed                    */
+  int       shmevent; /* event type of ShmCompletion                       */
   SILFB     *fb;
   SILEVENT se;
   SILEVENT pressed[100];
@@ -237,6 +245,9 @@ static int expose(XEvent *e) {
   /* can't do nothing if parameters are wrong, just exit */
 	if (0==s)      log_fatal("XGetGeometry Failed");
   if (24!=depth) log_fatal("Colordepth isn't 24 bits RGB");
+
+  /* window content is lost, so everything has to be placed again */
+  sil_addDirtyFB(gdisp.fb,0,0,gdisp.fb->width,gdisp.fb->height);
   sil_updateDisplay();
 	return 0;
 }
@@ -246,6 +257,16 @@ static int errorHandler(Display *d, XErrorEvent *e) {
 	return 0;
 }
 
+static int shmErrorHandler(Display *d, XErrorEvent *e) {
+  /* probably a remote X server, can't use shared memory */
+  gdisp.shmfail=1;
+  return 0;
+}
+
+static Bool isShmCompletion(Display *d, XEvent *e, XPointer arg) {
+  return (e->type==gdisp.shmevent);
+}
+
 static int fatalHandler(Display *d) {
 	fprintf(stderr, "X11 fatal: display=%p\n", (void *)d);
 	log_fatal("fatal X11 error");
@@ -447,6 +468,9 @@ SILEVENT *sil_getEventDisplay() {
           expose(&event);
           stop=1;
           break;
+        default:
+          if ((gdisp.useshm)&&(event.type==gdisp.shmevent)) gdisp.shmbusy=0;
+          break;
       }
   } while (!stop);
 	return &gdisp.se;
@@ -500,6 +524,87 @@ void sil_setCursor(BYTE type) {
 
 
 
+/*****************************************************************************
+
+  Internal function: try to create image in memory shared with X server 
+  (MIT-SHM extension), so updates don't have to be send through the 
+  connection. Framebuffer of display will use the same memory. Only works
+  if X server runs on same machine.
+  returns 1 if successful, 0 if not (and plain XPutImage should be used)
+
+ *****************************************************************************/
+
+static UINT initShm(UINT width, UINT height) {
+  BYTE *buf;
+  UINT size;
+  SILFB *shmfb;
+
+  if (!XShmQueryExtension(gdisp.display)) return 0;
+
+  gdisp.ximage=XShmCreateImage(gdisp.display,gdisp.visual,24,ZPixmap,NULL,&gdisp.shminfo,width,height);
+  if (NULL==gdisp.ximage) return 0;
+
+  /* rows of image will be used as rows of framebuffer */
+  if ((UINT)gdisp.ximage->bytes_per_line<gdisp.fb->width*4) {
+    XDestroyImage(gdisp.ximage);
+    gdisp.ximage=NULL;
+    return 0;
+  }
+
+  size=gdisp.ximage->bytes_per_line*gdisp.ximage->height;
+  gdisp.shminfo.shmid=shmget(IPC_PRIVATE,size,IPC_CREAT|0600);
+  if (-1==gdisp.shminfo.shmid) {
+    XDestroyImage(gdisp.ximage);
+    gdisp.ximage=NULL;
+    return 0;
+  }
+  buf=shmat(gdisp.shminfo.shmid,NULL,0);
+  if ((void *)-1==buf) {
+    shmctl(gdisp.shminfo.shmid,IPC_RMID,NULL);
+    XDestroyImage(gdisp.ximage);
+    gdisp.ximage=NULL;
+    return 0;
+  }
+  gdisp.shminfo.shmaddr=(char *)buf;
+  gdisp.shminfo.readOnly=False;
+  gdisp.ximage->data=(char *)buf;
+
+  /* errors of attaching are reported asynchronously, so wait for it */
+  gdisp.shmfail=0;
+  XSetErrorHandler(shmErrorHandler);
+  XShmAttach(gdisp.display,&gdisp.shminfo);
+  XSync(gdisp.display,False);
+  XSetErrorHandler(errorHandler);
+
+  /* memory will be released automatically when both sides detached */
+  shmctl(gdisp.shminfo.shmid,IPC_RMID,NULL);
+
+  if (gdisp.shmfail) {
+    shmdt(buf);
+    gdisp.ximage->data=NULL;
+    XDestroyImage(gdisp.ximage);
+    gdisp.ximage=NULL;
+    return 0;
+  }
+
+  /* let framebuffer use shared memory instead */
+  shmfb=sil_wrapFB(buf,gdisp.fb->width,gdisp.fb->height,gdisp.ximage->bytes_per_line,gdisp.fb->type);
+  if (NULL==shmfb) {
+    XShmDetach(gdisp.display,&gdisp.shminfo);
+    shmdt(buf);
+    gdisp.ximage->data=NULL;
+    XDestroyImage(gdisp.ximage);
+    gdisp.ximage=NULL;
+    return 0;
+  }
+  ReplaceFB(gdisp.fb,shmfb);
+  memset(buf,0,size);
+  gdisp.shmevent=XShmGetEventBase(gdisp.display)+ShmCompletion;
+  gdisp.useshm=1;
+  log_info("X11 display: using MIT-SHM");
+  return 1;
+}
+
 /*****************************************************************************
 
   Initialize Display (called by initSIL) ignoring first option, only needed
@@ -514,6 +619,8 @@ UINT sil_initDisplay(void *dummy, UINT width, UINT height, char * title) {
 
   gdisp.display=NULL;
   gdisp.ximage =NULL;
+  gdisp.useshm =0;
+  gdisp.shmbusy=0;
   gdisp.keys=0;
   gdisp.ctype=SILCUR_ARROW;
 
@@ -525,6 +632,7 @@ UINT sil_initDisplay(void *dummy, UINT width, UINT height, char * title) {
     sil_setErr(SILERR_NOTINIT);
     return SILERR_NOTINIT;
   }
+  SetDisplaySize(width,height);
 
 
   /* set handlers */
@@ -574,6 +682,17 @@ UINT sil_initDisplay(void *dummy, UINT width, UINT height, char * title) {
   gdisp.con=XConnectionNumber(gdisp.display);
 
   gdisp.visual=DefaultVisual(gdisp.display,gdisp.screen);
+
+  /* image is created once and reused for every update */
+  if (!initShm(width,height)) {
+    gdisp.ximage = XCreateImage(gdisp.display,gdisp.visual,24,ZPixmap,0,(char *)gdisp.fb->buf, width,height, 16,gdisp.fb->stride);
+    if (NULL==gdisp.ximage) log_fatal("cannot create image for window");
+    log_info("X11 display: using XPutImage");
+  }
+
+  /* RGBA like intel platforms */
+  gdisp.ximage->byte_order=LSBFirst;
+
   sil_setErr(SILERR_NOTINIT);
   return SILERR_ALLOK;
 }
@@ -585,22 +704,35 @@ UINT sil_initDisplay(void *dummy, UINT width, UINT height, char * title) {
  *****************************************************************************/
 
 void sil_updateDisplay() {
-  GC gc;
+  XEvent event;
+  SILBOX *box;
 
 	if (NULL==gdisp.fb) log_fatal("framebuffer not initialized");
-  LayersToFB(gdisp.fb);
-  
-  /* create colormap */
-  gc=XCreateGC(gdisp.display, gdisp.window, 0, &gdisp.gcvalues);
 
-  /* create image from framebuffer */
-  gdisp.ximage = XCreateImage(gdisp.display,gdisp.visual,24,ZPixmap,0,(char *)gdisp.fb->buf, gdisp.fb->width,gdisp.fb->height, 16,0);
+  /* don't change shared memory while X server is still reading from it, */
+  /* other events stay in queue for sil_getEventDisplay                   */
+  if (gdisp.shmbusy) {
+    XIfEvent(gdisp.display,&event,isShmCompletion,NULL);
+    gdisp.shmbusy=0;
+  }
 
-  /* RGBA like intel platforms */
-  gdisp.ximage->byte_order=LSBFirst;
+  LayersToFB(gdisp.fb);
 
-  /* place image on screen */
-  XPutImage(gdisp.display,gdisp.window,gc,gdisp.ximage,0,0,0,0, gdisp.fb->width, gdisp.fb->height);
+  /* place only changed parts of image on screen, ask for completion event */
+  /* only for the last one                                                 */
+  for (UINT i=0;i<gdisp.fb->dirtycnt;i++) {
+    box=&gdisp.fb->dirty[i];
+    if (gdisp.useshm) {
+      XShmPutImage(gdisp.display,gdisp.window,gdisp.context,gdisp.ximage,box->minx,box->miny,
+        box->minx,box->miny,box->width,box->height,(i+1==gdisp.fb->dirtycnt));
+      gdisp.shmbusy=1;
+    } else {
+      XPutImage(gdisp.display,gdisp.window,gdisp.context,gdisp.ximage,box->minx,box->miny,
+        box->minx,box->miny,box->width,box->height);
+    }
+  }
+  sil_clearDirtyFB(gdisp.fb);
+  XFlush(gdisp.display);
 }
 
 /*****************************************************************************
@@ -611,7 +743,20 @@ void sil_updateDisplay() {
 
 void sil_destroyDisplay() {
 	if (NULL != gdisp.display) {
+    if (gdisp.useshm) XShmDetach(gdisp.display,&gdisp.shminfo);
+    if (gdisp.ximage) {
+      /* image data is owned by framebuffer or shared memory */
+      gdisp.ximage->data=NULL;
+      XDestroyImage(gdisp.ximage);
+      gdisp.ximage=NULL;
+    }
+    XFreeGC(gdisp.display,gdisp.context);
 		XCloseDisplay(gdisp.display);
 	}
+  if (gdisp.useshm) {
+    shmdt(gdisp.shminfo.shmaddr);
+    gdisp.useshm=0;
+  }
   if (NULL!=gdisp.fb) sil_destroyFB(gdisp.fb);
+  gdisp.fb=NULL;
 }